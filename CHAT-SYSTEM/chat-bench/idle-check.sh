@@ -0,0 +1,52 @@
+#!/bin/sh
+# File: idle-check.sh
+# Date: 2026-10-19
+# Sp_04
+# Group member: Deyi, Zhizheng
+# Description: Idle-memory check behind "make test" (and the idle section of
+#              run-bench.sh). Starts a chat-server, opens BENCH_IDLE silent
+#              sessions (default 100000) and fails if they cost the server
+#              more than BENCH_BUDGET bytes each (default 2048). When the
+#              open file limit cannot hold that many sessions the check runs
+#              with as many as fit and says PARTIAL; below IDLE_MIN it says
+#              SKIP. Neither is reported as the full count.
+# Usage: sh chat-bench/idle-check.sh   (from CHAT-SYSTEM, after make)
+
+SERVER=./chat-server/bin/chat-server
+BENCH=./chat-bench/bin/chat-bench
+PORT=${BENCH_PORT:-18080}
+IDLE=${BENCH_IDLE:-100000}
+BUDGET=${BENCH_BUDGET:-2048}
+IDLE_MIN=1000     # Fewer sessions than this say little about the cost of one
+FD_SPARE=100      # Descriptors the server keeps besides its sessions
+
+sessions=$IDLE
+files=$(ulimit -Hn)
+if [ "$files" != unlimited ] && [ $((files - FD_SPARE)) -lt $IDLE ]; then
+    # Server and workers each need a descriptor per session
+    sessions=$((files - FD_SPARE))
+fi
+if [ $sessions -lt $IDLE_MIN ]; then
+    echo "idle check SKIP: open file limit $files leaves room for fewer than" \
+         "$IDLE_MIN of $IDLE sessions"
+    exit 0
+fi
+
+"$SERVER" --rate0 --iprate0 --port$PORT > /dev/null 2>&1 &
+server_pid=$!
+"$BENCH" --port$PORT --pid$server_pid --idle --count$sessions --budget$BUDGET
+result=$?
+kill $server_pid 2> /dev/null
+wait $server_pid 2> /dev/null
+
+if [ $result -ne 0 ]; then
+    echo "idle check FAIL: $sessions sessions, budget $BUDGET B each"
+    exit 1
+fi
+if [ $sessions -lt $IDLE ]; then
+    echo "idle check PARTIAL: $sessions of $IDLE sessions within $BUDGET B each;" \
+         "open file limit $files, the full count was not tried"
+else
+    echo "idle check PASS: $IDLE sessions within $BUDGET B each"
+fi
+exit 0
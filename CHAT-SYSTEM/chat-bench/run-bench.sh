@@ -0,0 +1,89 @@
+#!/bin/sh
+# File: run-bench.sh
+# Date: 2026-10-19
+# Sp_04
+# Group member: Deyi, Zhizheng
+# Description: Benchmark suite behind "make bench". Every section starts its
+#              own chat-server with the rate limits off, runs chat-bench
+#              against it and stops it again.
+# Usage: sh chat-bench/run-bench.sh   (from CHAT-SYSTEM, after make)
+
+SERVER=./chat-server/bin/chat-server
+BENCH=./chat-bench/bin/chat-bench
+PORT=${BENCH_PORT:-18080}
+SOCK=${BENCH_SOCK:-/tmp/chat-bench.sock}
+COUNT=${BENCH_COUNT:-20000}
+status=0
+
+# start_server <extra server options...>: runs a server in the background
+start_server() {
+    "$SERVER" --rate0 --iprate0 --port$PORT --unix$SOCK "$@" > /dev/null 2>&1 &
+    server_pid=$!
+}
+
+# stop_server: stops the server started last, if it is still up
+stop_server() {
+    kill $server_pid 2> /dev/null
+    wait $server_pid 2> /dev/null
+}
+
+# bench <options...>: runs one chat-bench against the current server
+bench() {
+    "$BENCH" --port$PORT --pid$server_pid "$@" || status=1
+}
+
+echo "== compression: 8 receivers, chat lines =="
+for mode in "" --compress; do
+    start_server
+    bench --count$COUNT --receivers8 $mode
+    stop_server
+done
+
+echo "== transports: ping-pong latency, then 1-receiver flood =="
+for size in 64 4096; do
+    for transport in "" --unix$SOCK "--unix$SOCK --shm"; do
+        start_server
+        bench --latency --count$COUNT --size$size $transport
+        stop_server
+        start_server
+        bench --count$COUNT --size$size $transport
+        stop_server
+    done
+done
+
+echo "== idle sessions: server memory per connection, 2 KiB budget =="
+BENCH_PORT=$PORT sh chat-bench/idle-check.sh || status=1
+
+echo "== TLS: registrations, then broadcast to 3 receivers =="
+if command -v openssl > /dev/null; then
+    TLSDIR=$(mktemp -d)
+    openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+        -addext subjectAltName=IP:127.0.0.1 \
+        -keyout $TLSDIR/key.pem -out $TLSDIR/cert.pem > /dev/null 2>&1
+    TLS="--tlscert$TLSDIR/cert.pem --tlskey$TLSDIR/key.pem"
+    CLIENT_TLS="--tls --tlsca$TLSDIR/cert.pem"
+    HANDSHAKES=$((COUNT / 20))
+
+    start_server
+    bench --handshake --count$HANDSHAKES
+    stop_server
+    start_server $TLS
+    bench --handshake --count$HANDSHAKES $CLIENT_TLS
+    stop_server
+    start_server $TLS
+    bench --handshake --count$HANDSHAKES $CLIENT_TLS --tlsresume$TLSDIR/ticket.pem
+    stop_server
+    for size in 64 4096; do
+        start_server
+        bench --count$COUNT --size$size --receivers3
+        stop_server
+        start_server $TLS
+        bench --count$COUNT --size$size --receivers3 $CLIENT_TLS
+        stop_server
+    done
+    rm -rf $TLSDIR
+else
+    echo "openssl not found, skipped"
+fi
+
+exit $status
@@ -0,0 +1,764 @@
+/*
+ * File: chat-bench.c
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Load generator for chat-server; "make bench" runs the
+ *              standard suite (see run-bench.sh)
+ * Flood: one sender streams --count messages of generated chat text to
+ *        --receivers clients, keeping at most FLOOD_WINDOW of them
+ *        unacknowledged. Reported: messages/s, frame bytes per delivery
+ *        and the CPU time of this process and, with --pid, of the server.
+ *        With --compress every connection negotiates deflate and the
+ *        sender compresses and the receivers inflate as chat-client does.
+ * Latency: --latency sends --count messages one at a time and times each from
+ *          send to the receiver's DELIVER; reported are p50, p99 and the
+ *          resulting messages/s.
+ * Handshake: --handshake registers --count sessions one after the other
+ *            (connect, TLS if asked for, HELLO/WELCOME, BYE) next to one
+ *            anchor session that keeps the server up. Reported are
+ *            registrations/s, how many TLS sessions were resumed and, with
+ *            --pid, the server CPU time per registration.
+ * Idle: --idle opens --count sessions that then stay silent, from worker
+ *       processes of at most IDLE_WORKER_SESSIONS (or the open file limit)
+ *       each; TCP workers dial from their own loopback address, for ports.
+ *       Once the server has had IDLE_SETTLE_MS to park them, the growth of
+ *       its RSS per session and its thread count (--pid is required) are
+ *       reported; more than --budget bytes per session (default
+ *       IDLE_BUDGET) fails.
+ * Transports: TCP by default, --unix[<path>] for the AF_UNIX listener and
+ *             --unix --shm for the shared-memory rings. --tls runs TCP
+ *             sessions over TLS, trusting --tlsca<file>; --tlsresume<file>
+ *             keeps the latest session ticket there and resumes with it.
+ * Text: --size0 (the default) sends chat lines of 4-30 words from a fixed
+ *       vocabulary, otherwise lines of exactly --size bytes. The generator
+ *       is seeded, so runs are comparable.
+ * Servers: start the server with --rate0 --iprate0, otherwise the rate
+ *          limit caps the result.
+ * Usage: ./chat-bench [--server<host>] [--port<n> | --unix[<path>] [--shm]]
+ *                     [--tls [--tlsca<file>] [--tlsresume<file>]]
+ *                     [--latency | --handshake | --idle [--budget<bytes>]]
+ *                     [--count<n>] [--size<bytes>] [--receivers<n>] [--compress]
+ *                     [--pid<server pid>]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "chat-protocol.h"
+#include "chat-compress.h"
+#include "chat-transport.h"
+#include "chat-tls.h"
+
+#define FLOOD_WINDOW 64         // Messages in flight before the sender waits
+#define MAX_RECEIVERS 64
+#define DIAL_RETRY_MS 2000      // Keep retrying while the server starts up
+#define RECEIVE_IDLE_MS 5000    // A receiver gives up after this much silence
+#define IDLE_SETTLE_MS 3000     // Longer than the server keeps an idle thread
+#define IDLE_BUDGET 2048        // Server bytes per idle session, default --budget
+#define IDLE_FD_SPARE 32        // Descriptors a worker keeps besides its sessions
+#define IDLE_WORKER_SESSIONS 10000 // Per worker, well inside one address's ephemeral ports
+
+/* Where and how to connect */
+typedef struct {
+    const char *host;
+    char port[8];
+    const char *unix_path;      // AF_UNIX listener instead of TCP, or NULL
+    uint8_t caps;               // FRAME_CAP_* requested in every HELLO
+    struct ssl_ctx_st *tls_ctx; // TLS client context, NULL for plaintext
+    const char *tls_resume;     // Session ticket file, or NULL
+    struct in_addr source;      // Local TCP address to dial from, 0 = any
+} Target;
+
+/* One receiving client of a flood */
+typedef struct {
+    Conn conn;
+    pthread_t thread;
+    uint64_t expected;          // Messages to wait for
+    uint64_t messages;          // Deliveries carrying FRAME_FLAG_HEAD
+    uint64_t frame_bytes;       // Header and payload bytes of every delivery
+    uint64_t done_ns;
+} Receiver;
+
+static const char *words[] = {
+    "hi", "hello", "hey", "all", "the", "a", "is", "it", "to", "and", "you", "i",
+    "we", "this", "that", "on", "in", "for", "at", "with", "just", "now", "ok",
+    "yes", "no", "lol", "thanks", "see", "meeting", "today", "tomorrow", "later",
+    "build", "server", "client", "test", "deploy", "fixed", "bug", "merged",
+    "review", "please", "anyone", "know", "why", "what", "when", "how", "back",
+    "lunch", "coffee", "done", "working", "looks", "good", "great", "sure",
+    "sorry", "late", "chat", "message", "send", "again", "works"
+};
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * Generates one line of chat text
+ * @param size 0 for 4-30 words, otherwise the exact length wanted
+ * @return bytes written to out (at most capacity)
+ */
+static size_t make_text(char *out, size_t capacity, size_t size, unsigned *seed) {
+    size_t length = 0;
+    int count = 4 + rand_r(seed) % 27;
+    size_t limit = size > 0 ? size : capacity;
+
+    for (int i = 0; size > 0 ? length < limit : i < count; i++) {
+        const char *word = words[rand_r(seed) % (sizeof(words) / sizeof(words[0]))];
+        size_t n = strlen(word);
+        if (length > 0 && length < limit) out[length++] = ' ';
+        if (n > limit - length) n = limit - length;
+        memcpy(out + length, word, n);
+        length += n;
+        if (length == limit) break;
+    }
+    return length;
+}
+
+/**
+ * Connects to the server, retrying for DIAL_RETRY_MS while it starts
+ * @return socket, or -1 after printing the error
+ */
+static int dial(const Target *target) {
+    struct addrinfo hints, *res = NULL;
+    struct sockaddr_un unix_addr;
+    uint64_t give_up = now_ns() + DIAL_RETRY_MS * 1000000ull;
+    int one = 1;
+
+    if (target->unix_path != NULL) {
+        memset(&unix_addr, 0, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        strncpy(unix_addr.sun_path, target->unix_path, sizeof(unix_addr.sun_path) - 1);
+    } else {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(target->host, target->port, &hints, &res) != 0) {
+            fprintf(stderr, "Cannot resolve %s\n", target->host);
+            return -1;
+        }
+    }
+    for (;;) {
+        int fd = res != NULL ? socket(res->ai_family, res->ai_socktype, 0)
+                             : socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && res != NULL && target->source.s_addr != 0) {
+            // The port is chosen at connect(), for the full 4-tuple
+            struct sockaddr_in local = { .sin_family = AF_INET, .sin_addr = target->source };
+            setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+            if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+                perror("Bind failed");
+                close(fd);
+                freeaddrinfo(res);
+                return -1;
+            }
+        }
+        int rc = fd < 0 ? -1
+                 : res != NULL ? connect(fd, res->ai_addr, res->ai_addrlen)
+                               : connect(fd, (struct sockaddr *)&unix_addr, sizeof(unix_addr));
+        if (rc == 0) {
+            if (res != NULL) {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                freeaddrinfo(res);
+            }
+            return fd;
+        }
+        int err = errno;
+        if (fd >= 0) close(fd);
+        if (now_ns() >= give_up) {
+            errno = err;
+            perror("Connect failed");
+            if (res != NULL) freeaddrinfo(res);
+            return -1;
+        }
+        usleep(20000);
+    }
+}
+
+/**
+ * Opens and registers one session
+ * @param extra_caps Capabilities wanted on top of target->caps
+ * @return 0 once WELCOME is in, -1 on failure
+ */
+static int open_session(const Target *target, Conn *conn, const char *user, uint8_t extra_caps) {
+    uint8_t caps = target->caps | extra_caps;
+    char hello[16];
+    FrameHeader hdr;
+    uint32_t limit;
+
+    int fd = dial(target);
+    if (fd < 0) return -1;
+    conn_init(conn, fd);
+    if (target->tls_ctx != NULL &&
+        tls_connect(conn, target->tls_ctx, target->host, target->tls_resume) < 0) {
+        fprintf(stderr, "TLS handshake of %s failed\n", user);
+        conn_close(conn);
+        return -1;
+    }
+    snprintf(hello, sizeof(hello), "USER:%s", user);
+    if (send_frame(conn, FRAME_HELLO, caps, 0, hello, strlen(hello)) < 0 ||
+        read_frame_header(conn, &hdr) < 0 || hdr.type != FRAME_WELCOME ||
+        hdr.length != sizeof(limit) || read_full(conn, &limit, sizeof(limit)) < 0) {
+        fprintf(stderr, "Registration of %s failed\n", user);
+        conn_close(conn);
+        return -1;
+    }
+    if ((hdr.flags & caps) != caps) {
+        fprintf(stderr, "Server declined capabilities 0x%02x\n", caps & ~hdr.flags);
+        conn_close(conn);
+        return -1;
+    }
+    if ((target->caps & FRAME_CAP_SHM) && shm_accept(conn) < 0) {
+        fprintf(stderr, "Shared-memory setup of %s failed\n", user);
+        conn_close(conn);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Waits on a presence session until the roster holds at least sessions
+ * users. The server welcomes a client before it joins the room, so
+ * without this the first messages could go out before every receiver
+ * is listening
+ * @return 0 when complete, -1 on error or after RECEIVE_IDLE_MS
+ */
+static int await_roster(Conn *conn, int sessions) {
+    unsigned char payload[FRAME_MAX_PAYLOAD];
+    FrameHeader hdr;
+    PresenceEntry entry;
+    int online = 0, more = 0;
+
+    while (online < sessions) {
+        if (read_frame_header_timeout(conn, &hdr, RECEIVE_IDLE_MS) != 0 ||
+            read_full(conn, payload, hdr.length) < 0) {
+            fprintf(stderr, "Only %d of %d sessions joined\n", online, sessions);
+            return -1;
+        }
+        if (hdr.type != FRAME_PRESENCE) continue;
+        // A split snapshot continues while its parts carry FRAME_FLAG_MORE
+        if ((hdr.flags & FRAME_FLAG_SNAPSHOT) && !more) online = 0;
+        more = (hdr.flags & FRAME_FLAG_SNAPSHOT) && (hdr.flags & FRAME_FLAG_MORE);
+        for (uint32_t off = 0; off + PRESENCE_ENTRY_SIZE <= hdr.length; off += PRESENCE_ENTRY_SIZE) {
+            decode_presence_entry(payload + off, PRESENCE_ENTRY_SIZE, &entry);
+            online += entry.op == PRESENCE_JOIN ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+/* Name of the transport a target uses, for the report */
+static const char *transport_name(const Target *target) {
+    if (target->caps & FRAME_CAP_SHM) return "shm";
+    if (target->tls_ctx != NULL) return "tls";
+    return target->unix_path != NULL ? "unix" : "tcp";
+}
+
+/* CPU seconds used by a process so far, from /proc; 0 if unknown */
+static double process_cpu(pid_t pid) {
+    char path[64], line[1024];
+    unsigned long utime, stime;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return 0;
+    char *fields = fgets(line, sizeof(line), fp) != NULL ? strrchr(line, ')') : NULL;
+    fclose(fp);
+    // After the command name: state, then 10 fields, then utime and stime
+    if (fields == NULL ||
+        sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime) != 2) {
+        return 0;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* CPU seconds used by this process */
+static double own_cpu(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * Reads one "<key> <n>" line of /proc/<pid>/status, such as VmRSS (KiB)
+ * @return the number, 0 if unknown
+ */
+static long process_status(pid_t pid, const char *key) {
+    char path[64], line[256];
+    long value = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, key, strlen(key)) == 0) {
+            value = strtol(line + strlen(key), NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return value;
+}
+
+/* Receiver thread: counts deliveries until all expected messages are in */
+static void *receive_loop(void *arg) {
+    Receiver *rx = arg;
+    char payload[FRAME_MAX_PAYLOAD];
+    char inflated[FRAME_CHUNK_SIZE];
+    FrameHeader hdr;
+
+    while (rx->messages < rx->expected) {
+        if (read_frame_header_timeout(&rx->conn, &hdr, RECEIVE_IDLE_MS) != 0 ||
+            read_full(&rx->conn, payload, hdr.length) < 0) {
+            break;
+        }
+        if (hdr.type != FRAME_DELIVER) continue;
+        rx->frame_bytes += FRAME_HEADER_SIZE + hdr.length;
+        if ((hdr.flags & FRAME_FLAG_DEFLATE) &&
+            decompress_payload(payload, hdr.length, inflated, sizeof(inflated)) < 0) {
+            fprintf(stderr, "Bad compressed delivery\n");
+            break;
+        }
+        if (hdr.flags & FRAME_FLAG_HEAD) rx->messages++;
+    }
+    rx->done_ns = now_ns();
+    compress_release();
+    return NULL;
+}
+
+/* Sends one single-frame message, deflated when the target negotiates it
+ * and that makes it smaller (as chat-client does) */
+static int send_text(const Target *target, Conn *conn, const char *text, size_t length) {
+    char packed[FRAME_CHUNK_SIZE];
+    size_t packed_len = 0;
+
+    if (target->caps & FRAME_CAP_DEFLATE) {
+        packed_len = compress_payload(text, length, packed, sizeof(packed));
+    }
+    return packed_len > 0 ? send_frame(conn, FRAME_TEXT, FRAME_FLAG_DEFLATE, 0, packed, packed_len)
+                          : send_frame(conn, FRAME_TEXT, 0, 0, text, length);
+}
+
+/* Reads frames from the sender's own connection until one answers a
+ * message (ACK, or THROTTLE if the server rate-limits) */
+static int await_answer(Conn *conn) {
+    char payload[FRAME_MAX_PAYLOAD];
+    FrameHeader hdr;
+
+    for (;;) {
+        if (read_frame_header(conn, &hdr) < 0 || read_full(conn, payload, hdr.length) < 0) {
+            return -1;
+        }
+        if (hdr.type == FRAME_ACK || hdr.type == FRAME_THROTTLE) return 0;
+    }
+}
+
+/**
+ * Runs one flood and prints its report line
+ * @return 0 if every receiver got every message, -1 otherwise
+ */
+static int run_flood(const Target *target, uint64_t count, size_t size, int receivers,
+                     pid_t server_pid) {
+    static Receiver rx[MAX_RECEIVERS];
+    char text[FRAME_CHUNK_SIZE], user[USER_ID_SIZE];
+    Conn sender;
+    unsigned seed = 1;
+    uint64_t in_flight = 0, text_bytes = 0;
+
+    for (int i = 0; i < receivers; i++) {
+        snprintf(user, sizeof(user), "r%d", i);
+        memset(&rx[i], 0, sizeof(rx[i]));
+        rx[i].expected = count;
+        if (open_session(target, &rx[i].conn, user, 0) < 0) return -1;
+    }
+    if (open_session(target, &sender, "send", FRAME_CAP_PRESENCE) < 0 ||
+        await_roster(&sender, receivers + 1) < 0) {
+        return -1;
+    }
+
+    double server_cpu = process_cpu(server_pid), bench_cpu = own_cpu();
+    uint64_t start = now_ns();
+    for (int i = 0; i < receivers; i++) pthread_create(&rx[i].thread, NULL, receive_loop, &rx[i]);
+
+    for (uint64_t sent = 0; sent < count; sent++) {
+        size_t length = make_text(text, sizeof(text), size, &seed);
+        text_bytes += length;
+        if (send_text(target, &sender, text, length) < 0) break;
+        if (++in_flight == FLOOD_WINDOW) {
+            if (await_answer(&sender) < 0) break;
+            in_flight--;
+        }
+    }
+    while (in_flight > 0 && await_answer(&sender) == 0) in_flight--;
+
+    uint64_t end = start, messages = 0, frame_bytes = 0;
+    for (int i = 0; i < receivers; i++) {
+        pthread_join(rx[i].thread, NULL);
+        if (rx[i].done_ns > end) end = rx[i].done_ns;
+        messages += rx[i].messages;
+        frame_bytes += rx[i].frame_bytes;
+    }
+    bench_cpu = own_cpu() - bench_cpu;
+    server_cpu = process_cpu(server_pid) - server_cpu;
+
+    double seconds = (end - start) / 1e9;
+    printf("flood %s %s, %d receiver(s), %s: %llu msgs in %.3f s, %.0f msg/s in, %.0f deliveries/s\n",
+           transport_name(target), (target->caps & FRAME_CAP_DEFLATE) ? "compressed" : "plain",
+           receivers,
+           size > 0 ? "fixed size" : "chat lines", (unsigned long long)count, seconds,
+           count / seconds, messages / seconds);
+    printf("  text %.1f B/msg, frames %.1f B/delivery; CPU: bench %.2f s",
+           (double)text_bytes / count, messages > 0 ? (double)frame_bytes / messages : 0,
+           bench_cpu);
+    if (server_pid > 0) printf(", server %.2f s (%.1f us/msg)", server_cpu, server_cpu * 1e6 / count);
+    printf("\n");
+
+    send_frame(&sender, FRAME_BYE, 0, 0, NULL, 0);
+    conn_close(&sender);
+    for (int i = 0; i < receivers; i++) {
+        send_frame(&rx[i].conn, FRAME_BYE, 0, 0, NULL, 0);
+        conn_close(&rx[i].conn);
+    }
+    compress_release();
+    if (messages != count * receivers) {
+        fprintf(stderr, "Lost %llu deliveries\n",
+                (unsigned long long)(count * receivers - messages));
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Runs a ping-pong latency test: each message is sent only after the
+ * previous one was delivered to the receiver and acknowledged to the sender
+ * @return 0 on success, -1 if a message went missing
+ */
+static int run_latency(const Target *target, uint64_t count, size_t size) {
+    char text[FRAME_CHUNK_SIZE], payload[FRAME_MAX_PAYLOAD];
+    uint64_t *samples = malloc(count * sizeof(uint64_t));
+    Conn sender, receiver;
+    FrameHeader hdr;
+    unsigned seed = 1;
+    uint64_t done = 0;
+
+    if (samples == NULL || open_session(target, &receiver, "recv", 0) < 0) {
+        free(samples);
+        return -1;
+    }
+    if (open_session(target, &sender, "send", FRAME_CAP_PRESENCE) < 0 ||
+        await_roster(&sender, 2) < 0) {
+        conn_close(&receiver);
+        free(samples);
+        return -1;
+    }
+    uint64_t start = now_ns();
+    while (done < count) {
+        size_t length = make_text(text, sizeof(text), size, &seed);
+        uint64_t sent = now_ns();
+        if (send_text(target, &sender, text, length) < 0) break;
+        int delivered = 0;
+        while (!delivered) {
+            if (read_frame_header_timeout(&receiver, &hdr, RECEIVE_IDLE_MS) != 0 ||
+                read_full(&receiver, payload, hdr.length) < 0) {
+                break;
+            }
+            delivered = hdr.type == FRAME_DELIVER && (hdr.flags & FRAME_FLAG_HEAD);
+        }
+        if (!delivered) break;
+        samples[done++] = now_ns() - sent;
+        if (await_answer(&sender) < 0) break;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    if (done > 0) {
+        qsort(samples, done, sizeof(uint64_t), compare_u64);
+        printf("latency %-4s %5zu B%s: p50 %6.1f us, p99 %6.1f us, %.0f msg/s (%llu msgs)\n",
+               transport_name(target), size,
+               (target->caps & FRAME_CAP_DEFLATE) ? " compressed" : "", samples[done / 2] / 1e3,
+               samples[done * 99 / 100] / 1e3, done / seconds, (unsigned long long)done);
+    }
+    send_frame(&sender, FRAME_BYE, 0, 0, NULL, 0);
+    send_frame(&receiver, FRAME_BYE, 0, 0, NULL, 0);
+    conn_close(&sender);
+    conn_close(&receiver);
+    free(samples);
+    if (done != count) {
+        fprintf(stderr, "Lost a message after %llu\n", (unsigned long long)done);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Registers count sessions back to back, each closed again right after
+ * its WELCOME; an anchor session stays open so a standalone server does
+ * not shut down between them
+ * @return 0 if every registration went through, -1 otherwise
+ */
+static int run_handshakes(const Target *target, uint64_t count, pid_t server_pid) {
+    char user[USER_ID_SIZE], description[96];
+    Conn anchor, conn;
+    uint64_t done = 0, resumed = 0;
+
+    if (open_session(target, &anchor, "hold", 0) < 0) return -1;
+    double server_cpu = process_cpu(server_pid), bench_cpu = own_cpu();
+    uint64_t start = now_ns();
+    for (; done < count; done++) {
+        snprintf(user, sizeof(user), "h%llu", (unsigned long long)(done % 10000));
+        if (open_session(target, &conn, user, 0) < 0) break;
+        if (target->tls_ctx != NULL) {
+            tls_describe(&conn, description, sizeof(description));
+            if (strstr(description, ", resumed") != NULL) resumed++;
+        }
+        send_frame(&conn, FRAME_BYE, 0, 0, NULL, 0);
+        conn_close(&conn);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    bench_cpu = own_cpu() - bench_cpu;
+    server_cpu = process_cpu(server_pid) - server_cpu;
+
+    printf("handshake %s%s: %llu registrations in %.3f s, %.0f/s",
+           transport_name(target), target->tls_resume != NULL ? " with tickets" : "",
+           (unsigned long long)done, seconds, done / seconds);
+    if (target->tls_ctx != NULL) printf(", %llu resumed", (unsigned long long)resumed);
+    printf("\n  CPU per registration: bench %.3f ms", done > 0 ? bench_cpu * 1e3 / done : 0);
+    if (server_pid > 0 && done > 0) printf(", server %.3f ms", server_cpu * 1e3 / done);
+    printf("\n");
+
+    send_frame(&anchor, FRAME_BYE, 0, 0, NULL, 0);
+    conn_close(&anchor);
+    return done == count ? 0 : -1;
+}
+
+/**
+ * Idle worker process: opens its share of the sessions, reports how many
+ * it got on ready_fd and keeps them open until release_fd is closed
+ * @return 0 if every session opened, 1 otherwise
+ */
+static int idle_worker(const Target *target, uint64_t sessions, int ready_fd, int release_fd) {
+    Conn *conns = calloc(sessions, sizeof(Conn));
+    char user[USER_ID_SIZE], done;
+    uint64_t opened = 0;
+
+    while (conns != NULL && opened < sessions) {
+        snprintf(user, sizeof(user), "i%llu", (unsigned long long)(opened % 10000));
+        if (open_session(target, &conns[opened], user, 0) < 0) break;
+        opened++;
+    }
+    if (write(ready_fd, &opened, sizeof(opened)) != sizeof(opened)) opened = 0;
+    while (read(release_fd, &done, 1) < 0 && errno == EINTR) {
+    }
+    // Reset rather than close, so back-to-back runs do not run out of
+    // ports to connections waiting in TIME_WAIT
+    struct linger reset = { 1, 0 };
+    for (uint64_t i = 0; i < opened; i++) {
+        setsockopt(conns[i].fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    }
+    return opened == sessions ? 0 : 1;
+}
+
+/* Whether a target's host is on the loopback network, 127.0.0.0/8 */
+static int loopback_target(const Target *target) {
+    struct addrinfo hints, *res;
+    int loopback = 0;
+
+    if (target->unix_path != NULL) return 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(target->host, target->port, &hints, &res) != 0) return 0;
+    loopback = (ntohl(((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr) >> 24) == 127;
+    freeaddrinfo(res);
+    return loopback;
+}
+
+/**
+ * Opens count idle sessions from worker processes and reports what they
+ * cost the server
+ * @param budget Server bytes per session the test allows
+ * @return 0 if every session opened within budget, -1 otherwise
+ */
+static int run_idle(const Target *target, uint64_t count, pid_t server_pid, long budget) {
+    struct rlimit files;
+    int ready[2], release[2];
+    uint64_t opened = 0, got;
+    int workers = 0, failed = 0;
+
+    // Each worker may use every descriptor the hard limit allows
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+        getrlimit(RLIMIT_NOFILE, &files);
+    }
+    uint64_t per_worker = files.rlim_cur > 2 * IDLE_FD_SPARE ? files.rlim_cur - IDLE_FD_SPARE
+                                                             : IDLE_FD_SPARE;
+    if (per_worker > IDLE_WORKER_SESSIONS) per_worker = IDLE_WORKER_SESSIONS;
+    int spread = loopback_target(target);
+    if (pipe(ready) < 0 || pipe(release) < 0) {
+        perror("Pipe creation failed");
+        return -1;
+    }
+
+    // The baseline is taken once the server is up and listening
+    int probe = dial(target);
+    if (probe < 0) return -1;
+    close(probe);
+    long rss_before = process_status(server_pid, "VmRSS:");
+    long threads_before = process_status(server_pid, "Threads:");
+    uint64_t start = now_ns();
+    for (uint64_t first = 0; first < count; first += per_worker) {
+        uint64_t sessions = count - first < per_worker ? count - first : per_worker;
+        Target own = *target;
+        // 127.0.0.2, .3, ...: every worker gets the full ephemeral port range
+        if (spread) own.source.s_addr = htonl((127u << 24) + 2 + workers);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(ready[0]);
+            close(release[1]);
+            _exit(idle_worker(&own, sessions, ready[1], release[0]));
+        }
+        if (pid < 0) {
+            perror("Fork failed");
+            break;
+        }
+        workers++;
+    }
+    close(ready[1]);
+    close(release[0]);
+    for (int i = 0; i < workers && read(ready[0], &got, sizeof(got)) == sizeof(got); i++) {
+        opened += got;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    usleep(IDLE_SETTLE_MS * 1000);
+    long rss_after = process_status(server_pid, "VmRSS:");
+    long threads_after = process_status(server_pid, "Threads:");
+    long per_session = opened > 0 ? (rss_after - rss_before) * 1024 / (long)opened : 0;
+    printf("idle %s: %llu of %llu sessions from %d worker(s) in %.3f s\n",
+           transport_name(target), (unsigned long long)opened, (unsigned long long)count,
+           workers, seconds);
+    printf("  server after %d ms: RSS %+ld KiB = %ld B per session (budget %ld B), "
+           "threads %ld -> %ld\n", IDLE_SETTLE_MS, rss_after - rss_before, per_session, budget,
+           threads_before, threads_after);
+
+    close(release[1]);
+    close(ready[0]);
+    while (workers > 0) {
+        int status;
+        if (wait(&status) < 0) break;
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        workers--;
+    }
+    if (opened != count || failed) {
+        fprintf(stderr, "Only %llu of %llu idle sessions opened\n",
+                (unsigned long long)opened, (unsigned long long)count);
+        return -1;
+    }
+    if (per_session > budget) {
+        fprintf(stderr, "Idle sessions cost %ld B each, over the %ld B budget\n",
+                per_session, budget);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Main benchmark function
+ * Parses the options and runs the selected test
+ */
+int main(int argc, char *argv[]) {
+    Target target = { "127.0.0.1", "", NULL, 0, NULL, NULL, { 0 } };
+    const char *tls_ca = NULL;
+    uint64_t count = 20000;
+    size_t size = 0;
+    int receivers = 1, latency = 0, handshake = 0, idle = 0, use_tls = 0;
+    long budget = IDLE_BUDGET;
+    pid_t server_pid = 0;
+
+    snprintf(target.port, sizeof(target.port), "%d", PORT);
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--server", 8) == 0) {
+            target.host = argv[i] + 8;
+        } else if (strncmp(argv[i], "--port", 6) == 0) {
+            snprintf(target.port, sizeof(target.port), "%s", argv[i] + 6);
+        } else if (strncmp(argv[i], "--unix", 6) == 0) {
+            target.unix_path = argv[i][6] != '\0' ? argv[i] + 6 : DEFAULT_UNIX_PATH;
+        } else if (strcmp(argv[i], "--shm") == 0) {
+            target.caps |= FRAME_CAP_SHM;
+        } else if (strcmp(argv[i], "--tls") == 0) {
+            use_tls = 1;
+        } else if (strncmp(argv[i], "--tlsca", 7) == 0) {
+            tls_ca = argv[i] + 7;
+        } else if (strncmp(argv[i], "--tlsresume", 11) == 0) {
+            target.tls_resume = argv[i] + 11;
+        } else if (strcmp(argv[i], "--latency") == 0) {
+            latency = 1;
+        } else if (strcmp(argv[i], "--handshake") == 0) {
+            handshake = 1;
+        } else if (strcmp(argv[i], "--idle") == 0) {
+            idle = 1;
+        } else if (strncmp(argv[i], "--budget", 8) == 0) {
+            budget = strtol(argv[i] + 8, NULL, 10);
+        } else if (strncmp(argv[i], "--count", 7) == 0) {
+            count = strtoull(argv[i] + 7, NULL, 10);
+        } else if (strncmp(argv[i], "--size", 6) == 0) {
+            size = strtoul(argv[i] + 6, NULL, 10);
+        } else if (strncmp(argv[i], "--receivers", 11) == 0) {
+            receivers = atoi(argv[i] + 11);
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            target.caps |= FRAME_CAP_DEFLATE;
+        } else if (strncmp(argv[i], "--pid", 5) == 0) {
+            server_pid = (pid_t)atoi(argv[i] + 5);
+        } else {
+            count = 0;
+            break;
+        }
+    }
+    if ((target.caps & FRAME_CAP_SHM) && target.unix_path == NULL) count = 0;
+    if (use_tls && target.unix_path != NULL) count = 0;
+    if (latency + handshake + idle > 1 || (idle && server_pid <= 0)) count = 0;
+    if (count == 0 || size > FRAME_CHUNK_SIZE || receivers < 1 || receivers > MAX_RECEIVERS) {
+        printf("Usage: %s [--server<host>] [--port<n> | --unix[<path>] [--shm]]"
+               " [--tls [--tlsca<file>] [--tlsresume<file>]]"
+               " [--latency | --handshake | --idle [--budget<bytes>]]"
+               " [--count<n>] [--size<bytes>] [--receivers<n>] [--compress] [--pid<server pid>]\n"
+               "  --size0 sends chat lines of 4-30 words, otherwise at most %d bytes;"
+               " 1 to %d receivers; --idle needs --pid\n", argv[0], FRAME_CHUNK_SIZE,
+               MAX_RECEIVERS);
+        return EXIT_FAILURE;
+    }
+    if (use_tls) {
+        // OpenSSL writes through plain write(); a lost server must fail it
+        signal(SIGPIPE, SIG_IGN);
+        target.tls_ctx = tls_client_ctx(tls_ca);
+        if (target.tls_ctx == NULL) return EXIT_FAILURE;
+    }
+    if (idle) return run_idle(&target, count, server_pid, budget) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (handshake) return run_handshakes(&target, count, server_pid) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (latency) return run_latency(&target, count, size) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    return run_flood(&target, count, size, receivers, server_pid) == 0 ? EXIT_SUCCESS
+                                                                       : EXIT_FAILURE;
+}
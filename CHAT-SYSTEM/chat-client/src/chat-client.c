@@ -11,10 +11,25 @@
  * - Connects to a chat server via TCP/IP
  * - Uses ncurses for terminal UI with separate chat and message windows
  * - Supports command-line arguments for user ID and server address
- * - Implements message splitting for long inputs
+ * - Streams long inputs as chunked frames and reassembles incoming ones
+ * - Optional deflate compression negotiated at registration
+ * - Messages (own ones included) shown in server seq order with server
+ *   timestamps; gaps in the sequence are reported
+ * - Reports own messages dropped by the server's rate limit
+ * - Same-host connections over AF_UNIX, optionally over shared-memory rings
+ * - Direct messages ("/msg <user> <text>") to a user on any cluster node
+ * - Presence: "/who" lists who is online, joins and leaves are announced
+ * - Optional TLS; the session ticket can be kept in a file so the next
+ *   connection resumes instead of doing a full handshake
+ * - Optional busy polling of the connection for lower receive latency
+ * - Headless mode for bots and bridges: input lines from stdin, received
+ *   messages as JSON lines on stdout (see run_headless)
  * - Handles server disconnections gracefully
  * 
- * Usage: ./client --user<ID> --server<IP_or_hostname>
+ * Usage: ./client --user<ID> --server<IP_or_hostname> [--port<n>] [--max<bytes>] [--compress]
+ *                 [--tls [--tlsca<file>] [--tlsresume<file>]] [--busypoll<us>] [--headless]
+ *        ./client --user<ID> --unix[<path>] [--shm] [--max<bytes>] [--compress] [--busypoll<us>]
+ *                 [--headless]
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,6 +38,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <pthread.h>
 #include <fcntl.h>
@@ -32,13 +48,47 @@
 #include <locale.h>
 #include <ctype.h>
 #include <poll.h>
+#include <signal.h>
+
+#include "chat-protocol.h"
+#include "chat-compress.h"
+#include "chat-tls.h"
 
-#define PORT 8080
-#define BUFFER_SIZE 68 // will eat 1 of 127 when it's 69???
-#define MESSAGE_SIZE 81
 #define DEFAULT_SERVER "127.0.0.1" // Default server if none provided
 #define DISPLAY_MESSAGE_SIZE 89
 #define SINGLE_MESSAGE_SIZE 40
+#define LABEL_SIZE 32              // "%-15s [%-5s] >> " sender label
+#define MAX_PENDING 16             // concurrently reassembled incoming messages
+#define MAX_ROSTER 512             // distinct users shown by /who
+#define NOTICE_SIZE 256            // presence notice text
+#define STDIO_BUFFER_SIZE (1 << 16) // headless stdin and JSON output buffers
+#define RECV_BUFFER_SIZE (1 << 16)  // received bytes, several frames per read
+
+/* Incoming message being reassembled from FRAME_FLAG_MORE chunks */
+typedef struct
+{
+    uint32_t stream;        // Sender session id, 0 when the slot is free
+    DeliverHead head;       // Sender and stamp from the head frame
+    char *text;             // Accumulated message text
+    size_t length;          // Bytes accumulated so far
+    int truncated;          // Exceeded max_message, rest discarded
+} PendingMessage;
+
+/* User online somewhere in the cluster */
+typedef struct
+{
+    char userID[USER_ID_SIZE];
+    uint16_t node;          // Node the user is on, 0 standalone
+    int sessions;           // Connections of this user on that node
+} RosterEntry;
+
+/* Own message sent but not yet acknowledged by the server */
+typedef struct OutgoingMessage
+{
+    char *text;
+    size_t length;
+    struct OutgoingMessage *next;
+} OutgoingMessage;
 
 // Global variable declarations
 volatile int client_running = 1;
@@ -46,13 +96,40 @@ WINDOW *chat_win, *msg_win;
 int shouldBlank = 0;
 int row = 0;
 char server_ip[16];
+char client_ip[INET_ADDRSTRLEN];
+uint16_t server_port = PORT;
+size_t max_message = DEFAULT_MAX_MESSAGE; // Effective per-message limit
+uint8_t session_caps = 0;                 // FRAME_CAP_* accepted by the server
+PendingMessage pending[MAX_PENDING];
+OutgoingMessage *outgoing_head = NULL, *outgoing_tail = NULL; // FIFO awaiting FRAME_ACK
+pthread_mutex_t outgoing_mutex = PTHREAD_MUTEX_INITIALIZER;
+char self_label[LABEL_SIZE];   // "%-15s [%-5s] >> " label for own messages
+uint64_t last_seq = 0;         // Highest seq seen in ROOM_LOBBY
+pthread_mutex_t display_mutex = PTHREAD_MUTEX_INITIALIZER; // Serialises msg_win updates
+RosterEntry roster[MAX_ROSTER]; // Who is online, kept from FRAME_PRESENCE
+int roster_count = 0;
+int snapshot_open = 0;         // Last snapshot part had FRAME_FLAG_MORE
+pthread_mutex_t roster_mutex = PTHREAD_MUTEX_INITIALIZER;
+int headless = 0;              // --headless: no ncurses, JSON lines on json_out
+FILE *json_out = NULL;         // The real stdout in headless mode
+volatile int closing = 0;      // BYE sent, the server hanging up is expected
 
 // Function prototypes
 void destroy_win(WINDOW *win);
-void input_win(WINDOW *win, char *message);
+void input_win(WINDOW *win, char *message, size_t limit);
 void display_win(WINDOW *win, char *word, int whichRow, int shouldBlank);
+void display_message(const char *label, const char *text, size_t length, time_t when);
+void display_system(const char *text);
 void blankWin(WINDOW *win);
-void *receive_messages(void *socket_ptr);
+int connect_tcp(int *sock, const char *server_name, char *client_ip);
+int send_message(Conn *conn, const char *message, size_t length);
+void send_direct_command(Conn *conn, const char *command);
+void queue_outgoing(const char *message, size_t length);
+void show_roster(void);
+void handle_command(Conn *conn, const char *message, size_t length);
+int run_headless(Conn *conn);
+void release_messages(void);
+void *receive_messages(void *conn_ptr);
 
 /**
  * Main function - Entry point for the chat client
@@ -62,6 +139,7 @@ void *receive_messages(void *socket_ptr);
  * - Socket creation and server connection
  * - Ncurses UI initialization with two windows (input and messages)
  * - Message input handling and transmission
+ * - Headless mode (stdin/stdout, no ncurses) with --headless
  * - Clean shutdown on exit command or server disconnect
  * 
  * @param argc Argument count
@@ -71,17 +149,41 @@ void *receive_messages(void *socket_ptr);
 int main(int argc, char *argv[])
 {
     int sock = 0;
-    struct sockaddr_in serv_addr;
+    Conn conn;
     char userID[6] = "guest";
     char server_name[100] = DEFAULT_SERVER; // Default server
+    const char *unix_path = NULL;           // Connect over AF_UNIX instead of TCP
+    uint8_t requested_caps = FRAME_CAP_PRESENCE;
+    int use_tls = 0;
+    const char *tls_ca = NULL;              // Trust store for the server certificate
+    const char *tls_resume = NULL;          // Session ticket file
+    int busy_poll_us = 0;                   // Spin before blocking on receive
     int i;
-    // Set up server address structure
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
 
     int chat_startx, chat_starty, chat_width, chat_height;
     int msg_startx, msg_starty, msg_width, msg_height;
 
+    // Headless stdout carries nothing but JSON lines, so it is switched
+    // before anything else is printed; the rest goes to stderr
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--headless") == 0)
+        {
+            headless = 1;
+        }
+    }
+    if (headless)
+    {
+        int json_fd = dup(STDOUT_FILENO);
+        if (json_fd < 0 || (json_out = fdopen(json_fd, "w")) == NULL ||
+            dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+        {
+            perror("Failed to set up headless output");
+            return EXIT_FAILURE;
+        }
+        setvbuf(json_out, NULL, _IOFBF, STDIO_BUFFER_SIZE);
+    }
+
     // Parse command line arguments
     for (i = 1; i < argc; i++)
     {
@@ -97,66 +199,167 @@ int main(int argc, char *argv[])
             server_name[99] = '\0'; // Ensure null termination
             printf("Server set to: %s\n", server_name);
         }
+        else if (strncmp(argv[i], "--max", 5) == 0)
+        {
+            long limit = strtol(argv[i] + 5, NULL, 10);
+            if (limit <= 0 || limit > MAX_MESSAGE_LIMIT)
+            {
+                printf("--max must be between 1 and %d bytes\n", MAX_MESSAGE_LIMIT);
+                return EXIT_FAILURE;
+            }
+            max_message = (size_t)limit;
+        }
+        else if (strcmp(argv[i], "--compress") == 0)
+        {
+            requested_caps |= FRAME_CAP_DEFLATE;
+        }
+        else if (strncmp(argv[i], "--unix", 6) == 0)
+        {
+            unix_path = argv[i][6] != '\0' ? argv[i] + 6 : DEFAULT_UNIX_PATH;
+        }
+        else if (strcmp(argv[i], "--shm") == 0)
+        {
+            requested_caps |= FRAME_CAP_SHM;
+        }
+        else if (strncmp(argv[i], "--port", 6) == 0)
+        {
+            long port = strtol(argv[i] + 6, NULL, 10);
+            if (port <= 0 || port > 65535)
+            {
+                printf("--port must be between 1 and 65535\n");
+                return EXIT_FAILURE;
+            }
+            server_port = (uint16_t)port;
+        }
+        else if (strcmp(argv[i], "--tls") == 0)
+        {
+            use_tls = 1;
+        }
+        else if (strncmp(argv[i], "--tlsca", 7) == 0)
+        {
+            tls_ca = argv[i] + 7;
+        }
+        else if (strncmp(argv[i], "--tlsresume", 11) == 0)
+        {
+            tls_resume = argv[i] + 11;
+        }
+        else if (strncmp(argv[i], "--busypoll", 10) == 0)
+        {
+            long usecs = strtol(argv[i] + 10, NULL, 10);
+            if (usecs <= 0 || usecs > 1000000)
+            {
+                printf("--busypoll must be between 1 and 1000000 us\n");
+                return EXIT_FAILURE;
+            }
+            busy_poll_us = (int)usecs;
+        }
+        else if (strcmp(argv[i], "--headless") == 0)
+        {
+            // Handled before parsing
+        }
         else
         {
-            printf("Usage: %s --user<userID> --server<server>\n", argv[0]);
+            printf("Usage: %s --user<userID> (--server<server> [--port<n>] | --unix[<path>] [--shm])"
+                   " [--max<bytes>] [--compress] [--tls [--tlsca<file>] [--tlsresume<file>]]"
+                   " [--busypoll<us>] [--headless]\n",
+                   argv[0]);
             return EXIT_FAILURE;
         }
     }
-
-    // Create socket
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if ((requested_caps & FRAME_CAP_SHM) && unix_path == NULL)
     {
-        perror("Socket creation error");
+        printf("--shm requires --unix\n");
+        return EXIT_FAILURE;
+    }
+    if (use_tls && unix_path != NULL)
+    {
+        printf("--tls is for TCP connections\n");
         return EXIT_FAILURE;
     }
 
-    // Convert server name to IP address
-    if (inet_pton(AF_INET, server_name, &serv_addr.sin_addr) <= 0)
+    if (unix_path != NULL)
     {
-        // Not a valid IP address, try as hostname
-        struct hostent *he;
-        if ((he = gethostbyname(server_name)) == NULL)
+        // Same-host connection: no IP stack, both ends are loopback
+        struct sockaddr_un unix_addr;
+        memset(&unix_addr, 0, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        strncpy(unix_addr.sun_path, unix_path, sizeof(unix_addr.sun_path) - 1);
+        if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            connect(sock, (struct sockaddr *)&unix_addr, sizeof(unix_addr)) < 0)
         {
-            printf("Could not resolve hostname: %s\n", server_name);
+            perror("Connection Failed");
             return EXIT_FAILURE;
         }
-        // Copy the first IP address from the list
-        memcpy(&serv_addr.sin_addr, he->h_addr_list[0], he->h_length);
+        strcpy(server_ip, "127.0.0.1");
+        strcpy(client_ip, "127.0.0.1");
+        printf("Connected to server at %s\n", unix_path);
     }
-
-    // Connect to server
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    else if (connect_tcp(&sock, server_name, client_ip) < 0)
     {
-        perror("Connection Failed");
         return EXIT_FAILURE;
     }
-    // Convert server IP to string
-    inet_ntop(AF_INET, &serv_addr.sin_addr, server_ip, INET_ADDRSTRLEN);
-    printf("Connected to server at %s:%d\n", server_name, PORT);
-
-    // Get client's own IP address
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-
-    if (getsockname(sock, (struct sockaddr *)&client_addr, &addr_len) == -1)
+    conn_init(&conn, sock);
+    if (busy_poll_us > 0)
     {
-        perror("getsockname failed");
-        close(sock);
-        return EXIT_FAILURE;
+        conn_set_busy_poll(&conn, busy_poll_us);
+    }
+    if (use_tls)
+    {
+        // OpenSSL writes through plain write(): a lost server must fail
+        // the write instead of killing the client
+        signal(SIGPIPE, SIG_IGN);
+        struct ssl_ctx_st *tls_ctx = tls_client_ctx(tls_ca);
+        char description[96];
+        if (tls_ctx == NULL || tls_connect(&conn, tls_ctx, server_name, tls_resume) < 0)
+        {
+            printf("TLS handshake failed\n");
+            conn_close(&conn);
+            return EXIT_FAILURE;
+        }
+        tls_describe(&conn, description, sizeof(description));
+        printf("Secured with %s\n", description);
     }
-
-    // Convert binary IP to string
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-    printf("Client IP: %s\n", client_ip); // Optional debug
 
     // First send userID to register with server
     char reg_message[20] = {0};
     sprintf(reg_message, "USER:%s", userID);
-    send(sock, reg_message, strlen(reg_message), 0);
-    printf("Registered with server as %s\n", userID);
+    send_frame(&conn, FRAME_HELLO, requested_caps, 0, reg_message, strlen(reg_message));
+
+    // Server answers with its message size limit; honour the smaller one
+    FrameHeader hdr;
+    uint32_t server_limit;
+    if (read_frame_header(&conn, &hdr) < 0 || hdr.type != FRAME_WELCOME ||
+        hdr.length != sizeof(server_limit) ||
+        read_full(&conn, &server_limit, sizeof(server_limit)) < 0)
+    {
+        printf("Registration rejected by server\n");
+        conn_close(&conn);
+        return EXIT_FAILURE;
+    }
+    if (ntohl(server_limit) < max_message)
+    {
+        max_message = ntohl(server_limit);
+    }
+    session_caps = hdr.flags & requested_caps;
+    if ((session_caps & FRAME_CAP_SHM) && shm_accept(&conn) < 0)
+    {
+        printf("Shared memory setup failed\n");
+        conn_close(&conn);
+        return EXIT_FAILURE;
+    }
+    printf("Registered with server as %s (max message %zu bytes%s%s)\n", userID, max_message,
+           (session_caps & FRAME_CAP_DEFLATE) ? ", compressed" : "",
+           (session_caps & FRAME_CAP_SHM) ? ", shared memory" : "");
     printf("Enter messages (or 'bye' to quit):\n");
+    snprintf(self_label, LABEL_SIZE, "%-15s [%-5s] >> ", client_ip, userID);
+
+    if (headless)
+    {
+        int status = run_headless(&conn);
+        release_messages();
+        conn_close(&conn);
+        return status;
+    }
 
     // Initialize ncurses
     setlocale(LC_ALL, "");
@@ -203,244 +406,1024 @@ int main(int argc, char *argv[])
 
     // Start receive thread
     pthread_t receive_thread;
-    if (pthread_create(&receive_thread, NULL, receive_messages, &sock) != 0)
+    if (pthread_create(&receive_thread, NULL, receive_messages, &conn) != 0)
     {
         perror("Failed to create receive thread");
-        close(sock);
+        conn_close(&conn);
         return EXIT_FAILURE;
     }
     // Chat loop
-    char message[MESSAGE_SIZE] = {0};
+    char *message = malloc(max_message + 1);
+    if (message == NULL)
+    {
+        endwin();
+        perror("Failed to allocate message buffer");
+        return EXIT_FAILURE;
+    }
     while (client_running)
     {
         // Clear previous message
         wclear(chat_win);
         box(chat_win, 0, 0);
 
-        input_win(chat_win, message);
+        input_win(chat_win, message, max_message);
 
         // Check for exit
         if (strcmp(message, "bye") == 0)
         {
+            send_frame(&conn, FRAME_BYE, 0, 0, NULL, 0);
             break;
         }
 
-        // format self message:
-        char timestamp[20];
-        time_t rawtime;
-        struct tm timeinfo;
-        // Get current time
-        time(&rawtime);
-        localtime_r(&rawtime, &timeinfo);
-        strftime(timestamp, sizeof(timestamp), "(%H:%M:%S)", &timeinfo);
+        handle_command(&conn, message, strlen(message));
+    }
+    free(message);
+
+    client_running = 0;                 // Signal receive thread to exit
+    pthread_join(receive_thread, NULL); // Wait for receive thread to finish
+    release_messages();
+
+    // Cleanup ncurses windows and end curses mode
+    delwin(msg_win);
+    delwin(chat_win);
+    endwin();
+
+    // Close the connection
+    conn_close(&conn);
+
+    return 0;
+}
+
+/**
+ * Acts on one line of input: a command, or a message for the room
+ * @param conn Server connection
+ * @param message Input line without its newline, NUL-terminated
+ * @param length Line length in bytes
+ */
+void handle_command(Conn *conn, const char *message, size_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+    if (strncmp(message, "/msg ", 5) == 0)
+    {
+        send_direct_command(conn, message + 5);
+        return;
+    }
+    if (strcmp(message, "/who") == 0)
+    {
+        show_roster();
+        return;
+    }
+    if (length > max_message)
+    {
+        display_system("Message too long, not sent.");
+        return;
+    }
+    // Own message is displayed when the server acknowledges it, with the
+    // server's stamp, so it lands in the same order everyone else sees
+    queue_outgoing(message, length);
+    send_message(conn, message, length);
+}
+
+/**
+ * Runs the client without ncurses, for bots and bridges
+ *
+ * Every stdin line is handled like a line typed into the input window
+ * ("bye" or end of input quits). Everything the window would show is
+ * written to stdout as one JSON object per line instead. Both sides go
+ * through large stdio buffers: the receive thread flushes only once it
+ * has caught up with the connection, so a burst costs a few write calls
+ * rather than one per message. At the end the client says BYE and keeps
+ * reading until the server hangs up, so acks for the last messages sent
+ * are still reported.
+ *
+ * @param conn Registered server connection
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the server went away first
+ */
+int run_headless(Conn *conn)
+{
+    pthread_t receive_thread;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+
+    setvbuf(stdin, NULL, _IOFBF, STDIO_BUFFER_SIZE);
+    if (pthread_create(&receive_thread, NULL, receive_messages, conn) != 0)
+    {
+        perror("Failed to create receive thread");
+        return EXIT_FAILURE;
+    }
+    while (client_running && (length = getline(&line, &capacity, stdin)) >= 0)
+    {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+        {
+            line[--length] = '\0';
+        }
+        if (strcmp(line, "bye") == 0)
+        {
+            break;
+        }
+        handle_command(conn, line, (size_t)length);
+    }
+    free(line);
+
+    int server_gone = !client_running;
+    closing = 1;
+    send_frame(conn, FRAME_BYE, 0, 0, NULL, 0);
+    pthread_join(receive_thread, NULL);
+    fflush(json_out);
+    return server_gone ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Frees reassembly buffers and own messages still awaiting an ack */
+void release_messages(void)
+{
+    for (int i = 0; i < MAX_PENDING; i++)
+    {
+        free(pending[i].text);
+    }
+    while (outgoing_head != NULL)
+    {
+        OutgoingMessage *next = outgoing_head->next;
+        free(outgoing_head->text);
+        free(outgoing_head);
+        outgoing_head = next;
+    }
+}
+
+/**
+ * Connects to the server over TCP
+ *
+ * Resolves server_name (IP address or hostname), connects to PORT and
+ * records both ends' addresses for display.
+ *
+ * @param sock Receives the connected socket
+ * @param server_name Server IP address or hostname
+ * @param client_ip Receives our own address (INET_ADDRSTRLEN bytes)
+ * @return 0 on success, -1 on failure (already reported)
+ */
+int connect_tcp(int *sock, const char *server_name, char *client_ip)
+{
+    struct sockaddr_in serv_addr;
+    // Set up server address structure
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(server_port);
+
+    // Create socket
+    if ((*sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        perror("Socket creation error");
+        return -1;
+    }
+
+    // Convert server name to IP address
+    if (inet_pton(AF_INET, server_name, &serv_addr.sin_addr) <= 0)
+    {
+        // Not a valid IP address, try as hostname
+        struct hostent *he;
+        if ((he = gethostbyname(server_name)) == NULL)
+        {
+            printf("Could not resolve hostname: %s\n", server_name);
+            return -1;
+        }
+        // Copy the first IP address from the list
+        memcpy(&serv_addr.sin_addr, he->h_addr_list[0], he->h_length);
+    }
+
+    // Connect to server
+    if (connect(*sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    {
+        perror("Connection Failed");
+        return -1;
+    }
+    // Convert server IP to string
+    inet_ntop(AF_INET, &serv_addr.sin_addr, server_ip, INET_ADDRSTRLEN);
+    printf("Connected to server at %s:%d\n", server_name, server_port);
+
+    // Get client's own IP address
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+
+    if (getsockname(*sock, (struct sockaddr *)&client_addr, &addr_len) == -1)
+    {
+        perror("getsockname failed");
+        close(*sock);
+        return -1;
+    }
+
+    // Convert binary IP to string
+    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+    printf("Client IP: %s\n", client_ip); // Optional debug
+    return 0;
+}
+
+/**
+ * Streams a message to the server as FRAME_CHUNK_SIZE frames
+ *
+ * Every chunk but the last carries FRAME_FLAG_MORE so the server can
+ * forward it immediately instead of waiting for the whole message.
+ * Chunks are deflated when negotiated and it makes them smaller.
+ *
+ * @param conn Server connection
+ * @param message Message text (not necessarily NUL-terminated)
+ * @param length Message length in bytes
+ * @return 0 on success, -1 on send failure
+ */
+int send_message(Conn *conn, const char *message, size_t length)
+{
+    static char packed[FRAME_CHUNK_SIZE]; // Only used by the input thread
+    do
+    {
+        uint32_t chunk = length > FRAME_CHUNK_SIZE ? FRAME_CHUNK_SIZE : (uint32_t)length;
+        uint8_t flags = length > chunk ? FRAME_FLAG_MORE : 0;
+        size_t packed_len = 0;
+        if (session_caps & FRAME_CAP_DEFLATE)
+        {
+            packed_len = compress_payload(message, chunk, packed, sizeof(packed));
+        }
+        int rc = packed_len > 0
+                     ? send_frame(conn, FRAME_TEXT, flags | FRAME_FLAG_DEFLATE, 0, packed, packed_len)
+                     : send_frame(conn, FRAME_TEXT, flags, 0, message, chunk);
+        if (rc < 0)
+        {
+            return -1;
+        }
+        message += chunk;
+        length -= chunk;
+    } while (length > 0);
+    return 0;
+}
+
+/* Writes text as a JSON string; bytes >= 0x80 pass through unchanged.
+ * The caller holds json_out's lock */
+static void json_quote(const char *text, size_t length)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t start = 0;
+
+    putc_unlocked('"', json_out);
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = (unsigned char)text[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+        {
+            continue;
+        }
+        fwrite(text + start, 1, i - start, json_out);
+        putc_unlocked('\\', json_out);
+        if (c == '"' || c == '\\')
+        {
+            putc_unlocked(c, json_out);
+        }
+        else if (c == '\n')
+        {
+            putc_unlocked('n', json_out);
+        }
+        else if (c == '\t')
+        {
+            putc_unlocked('t', json_out);
+        }
+        else
+        {
+            fprintf(json_out, "u00%c%c", hex[c >> 4], hex[c & 15]);
+        }
+        start = i + 1;
+    }
+    fwrite(text + start, 1, length - start, json_out);
+    putc_unlocked('"', json_out);
+}
+
+/* Starts a JSON line {"type":"<type>"; json_end() finishes it. Lines from
+ * both threads never interleave */
+static void json_begin(const char *type)
+{
+    flockfile(json_out);
+    fprintf(json_out, "{\"type\":\"%s\"", type);
+}
+
+/* Adds "key":"text" to the current JSON line */
+static void json_string(const char *key, const char *text, size_t length)
+{
+    fprintf(json_out, ",\"%s\":", key);
+    json_quote(text, length);
+}
+
+/* Adds "key":value to the current JSON line */
+static void json_number(const char *key, uint64_t value)
+{
+    fprintf(json_out, ",\"%s\":%llu", key, (unsigned long long)value);
+}
+
+static void json_end(void)
+{
+    fputs("}\n", json_out);
+    funlockfile(json_out);
+}
+
+/**
+ * Handles "/msg <user> <text>": sends a direct message in one frame
+ *
+ * Direct messages are outside the room sequence and never acknowledged,
+ * so the own copy is shown right away; the server answers with an error
+ * if the user is unknown.
+ *
+ * @param conn Server connection
+ * @param command Text after "/msg "
+ */
+void send_direct_command(Conn *conn, const char *command)
+{
+    static char payload[FRAME_CHUNK_SIZE]; // Only used by the input thread
+    char target[USER_ID_SIZE];
+    char label[LABEL_SIZE];
+    const char *space = strchr(command, ' ');
+    size_t name_length = space != NULL ? (size_t)(space - command) : 0;
+
+    if (name_length == 0 || name_length > USER_ID_SIZE - 1 || space[1] == '\0')
+    {
+        display_system("Usage: /msg <user> <text>");
+        return;
+    }
+    const char *text = space + 1;
+    size_t length = strlen(text);
+    if (length > sizeof(payload) - (USER_ID_SIZE - 1))
+    {
+        display_system("Direct message too long.");
+        return;
+    }
+    memcpy(target, command, name_length);
+    target[name_length] = '\0';
+    memset(payload, 0, USER_ID_SIZE - 1);
+    memcpy(payload, target, name_length);
+    memcpy(payload + USER_ID_SIZE - 1, text, length);
+    if (send_frame(conn, FRAME_DIRECT, 0, 0, payload, USER_ID_SIZE - 1 + length) != 0)
+    {
+        return;
+    }
+    if (headless)
+    {
+        json_begin("direct_sent");
+        json_string("to", target, name_length);
+        json_string("text", text, length);
+        json_end();
+        return;
+    }
+    snprintf(label, LABEL_SIZE, "%-15s [%-5s] @> ", client_ip, target);
+    display_message(label, text, length, time(NULL));
+}
 
-        send(sock, message, strlen(message), 0);
+/* Remembers an own message until its FRAME_ACK arrives */
+void queue_outgoing(const char *message, size_t length)
+{
+    OutgoingMessage *out = malloc(sizeof(*out));
+    if (out == NULL || (out->text = malloc(length)) == NULL)
+    {
+        free(out);
+        return;
+    }
+    memcpy(out->text, message, length);
+    out->length = length;
+    out->next = NULL;
+
+    pthread_mutex_lock(&outgoing_mutex);
+    if (outgoing_tail != NULL)
+    {
+        outgoing_tail->next = out;
+    }
+    else
+    {
+        outgoing_head = out;
+    }
+    outgoing_tail = out;
+    pthread_mutex_unlock(&outgoing_mutex);
+}
+
+/* Takes the oldest unacknowledged own message, or NULL */
+static OutgoingMessage *dequeue_outgoing(void)
+{
+    pthread_mutex_lock(&outgoing_mutex);
+    OutgoingMessage *out = outgoing_head;
+    if (out != NULL)
+    {
+        outgoing_head = out->next;
+        if (outgoing_head == NULL)
+        {
+            outgoing_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&outgoing_mutex);
+    return out;
+}
 
-        // parcel the message
-        if (strlen(message) < SINGLE_MESSAGE_SIZE)
+/**
+ * Tracks the room sequence and reports skipped messages
+ *
+ * The server stamps and sends under one lock, so every client sees seq
+ * values in increasing order; a jump means messages were lost to us.
+ *
+ * @param stamp Stamp of the message just received or acknowledged
+ */
+static void note_seq(const MessageStamp *stamp)
+{
+    if (last_seq != 0 && stamp->seq > last_seq + 1)
+    {
+        if (headless)
         {
-            char selfmessage[DISPLAY_MESSAGE_SIZE];
-            snprintf(selfmessage, DISPLAY_MESSAGE_SIZE,
-                     "%-15s [%-5s] >> %-40s %s",
-                     client_ip,
-                     userID,
-                     message,
-                     timestamp);
-            display_win(msg_win, selfmessage, row, shouldBlank);
-            row++;
+            json_begin("missed");
+            json_number("count", stamp->seq - last_seq - 1);
+            json_end();
         }
         else
         {
+            char notice[64];
+            snprintf(notice, sizeof(notice), "[%llu message(s) missed]",
+                     (unsigned long long)(stamp->seq - last_seq - 1));
+            display_system(notice);
+        }
+    }
+    if (stamp->seq > last_seq)
+    {
+        last_seq = stamp->seq;
+    }
+}
 
-            // Split into two chunks (max 80 chars input)
-            char chunk1[SINGLE_MESSAGE_SIZE + 1];
-            char chunk2[SINGLE_MESSAGE_SIZE + 1];
+/**
+ * Handles a FRAME_ACK: displays the oldest own message with its stamp
+ * @param payload Encoded MessageStamp
+ * @param length Payload length
+ */
+static void handle_ack(const char *payload, uint32_t length)
+{
+    MessageStamp stamp;
+    if (decode_message_stamp((const unsigned char *)payload, length, &stamp) < 0)
+    {
+        return;
+    }
+    note_seq(&stamp);
 
-            // First chunk (40 chars)
-            strncpy(chunk1, message, SINGLE_MESSAGE_SIZE);
-            chunk1[SINGLE_MESSAGE_SIZE] = '\0';
+    OutgoingMessage *out = dequeue_outgoing();
+    if (out != NULL && headless)
+    {
+        json_begin("sent");
+        json_number("seq", stamp.seq);
+        json_number("ts", stamp.timestamp_ms);
+        json_string("text", out->text, out->length);
+        json_end();
+    }
+    else if (out != NULL)
+    {
+        display_message(self_label, out->text, out->length, (time_t)(stamp.timestamp_ms / 1000));
+    }
+    if (out != NULL)
+    {
+        free(out->text);
+        free(out);
+    }
+}
+
+/**
+ * Handles a FRAME_THROTTLE: the oldest own message was dropped unsent
+ * @param payload uint32 milliseconds until the server accepts messages again
+ * @param length Payload length
+ */
+static void handle_throttle(const char *payload, uint32_t length)
+{
+    uint32_t retry_ms = 0;
+    if (length >= sizeof(retry_ms))
+    {
+        memcpy(&retry_ms, payload, sizeof(retry_ms));
+        retry_ms = ntohl(retry_ms);
+    }
+
+    OutgoingMessage *out = dequeue_outgoing();
+    if (headless)
+    {
+        json_begin("throttled");
+        if (out != NULL)
+        {
+            json_string("text", out->text, out->length);
+        }
+        json_number("retry_ms", retry_ms);
+        json_end();
+    }
+    else
+    {
+        char notice[64];
+        snprintf(notice, sizeof(notice), "Too fast, message dropped (retry in %u ms).", retry_ms);
+        display_system(notice);
+    }
+    if (out != NULL)
+    {
+        free(out->text);
+        free(out);
+    }
+}
+
+/* Formats "bob", "bob@2" or "bob@2 x3" for presence output */
+static void format_user(char *out, size_t size, const char *userID, uint16_t node, int sessions)
+{
+    int n = snprintf(out, size, "%s", userID);
+    if (node != 0 && n < (int)size)
+    {
+        n += snprintf(out + n, size - n, "@%u", node);
+    }
+    if (sessions > 1 && n < (int)size)
+    {
+        snprintf(out + n, size - n, " x%d", sessions);
+    }
+}
+
+/* Appends " <word>" to a notice, ending it with "..." once it is full */
+static void append_word(char *notice, const char *word)
+{
+    size_t used = strlen(notice);
+    if (used + strlen(word) + 5 > NOTICE_SIZE)
+    {
+        if (used + 4 < NOTICE_SIZE && strcmp(notice + used - 3, "...") != 0)
+        {
+            strcat(notice, " ...");
+        }
+        return;
+    }
+    strcat(notice, " ");
+    strcat(notice, word);
+}
 
-            // Second chunk (remaining chars)
-            int remaining = strlen(message) - SINGLE_MESSAGE_SIZE;
-            if (remaining > 0)
+/**
+ * Applies one presence change to the roster; caller holds roster_mutex
+ * @return 1 if the roster changed, 0 if the entry was unknown or full
+ */
+static int roster_apply(const PresenceEntry *entry)
+{
+    for (int i = 0; i < roster_count; i++)
+    {
+        if (roster[i].node == entry->node && strcmp(roster[i].userID, entry->userID) == 0)
+        {
+            if (entry->op == PRESENCE_JOIN)
             {
-                strncpy(chunk2, message + SINGLE_MESSAGE_SIZE, remaining);
-                chunk2[remaining] = '\0';
+                roster[i].sessions++;
             }
-            else
+            else if (--roster[i].sessions == 0)
             {
-                chunk2[0] = '\0'; // Empty second chunk
+                roster[i] = roster[--roster_count];
             }
+            return 1;
+        }
+    }
+    if (entry->op != PRESENCE_JOIN || roster_count == MAX_ROSTER)
+    {
+        return 0;
+    }
+    memcpy(roster[roster_count].userID, entry->userID, USER_ID_SIZE);
+    roster[roster_count].node = entry->node;
+    roster[roster_count].sessions = 1;
+    roster_count++;
+    return 1;
+}
 
-            // Display first chunk
-            char selfmessage[DISPLAY_MESSAGE_SIZE];
-            snprintf(selfmessage, DISPLAY_MESSAGE_SIZE,
-                     "%-15s [%-5s] >> %-40s %s",
-                     client_ip,
-                     userID,
-                     chunk1,
-                     timestamp);
-            display_win(msg_win, selfmessage, row, shouldBlank);
-            row++;
-
-            // Display second chunk if not empty
-            if (remaining > 0)
-            {
-                snprintf(selfmessage, DISPLAY_MESSAGE_SIZE,
-                         "%-15s [%-5s] >> %-40s %s",
-                         client_ip,
-                         userID,
-                         chunk2,
-                         timestamp);
-                display_win(msg_win, selfmessage, row, shouldBlank);
-                row++;
-            }
+/**
+ * Handles a FRAME_PRESENCE: a snapshot replaces the roster, a diff is
+ * applied to it and announced as one line, however many users it carries
+ * The parts of a split snapshot are collected before it is announced
+ * @param hdr Frame header (FRAME_FLAG_SNAPSHOT, FRAME_FLAG_MORE)
+ * @param payload Presence entries
+ */
+static void handle_presence(const FrameHeader *hdr, const char *payload)
+{
+    char joined[NOTICE_SIZE] = "Joined:", left[NOTICE_SIZE] = "Left:";
+    char name[16];
+    PresenceEntry entry;
+    int total = 0;
+
+    pthread_mutex_lock(&roster_mutex);
+    if ((hdr->flags & FRAME_FLAG_SNAPSHOT) && !snapshot_open)
+    {
+        roster_count = 0;
+    }
+    snapshot_open = (hdr->flags & FRAME_FLAG_SNAPSHOT) && (hdr->flags & FRAME_FLAG_MORE);
+    for (uint32_t offset = 0;
+         decode_presence_entry((const unsigned char *)payload + offset, hdr->length - offset, &entry) == 0;
+         offset += PRESENCE_ENTRY_SIZE)
+    {
+        if (!roster_apply(&entry) || (hdr->flags & FRAME_FLAG_SNAPSHOT))
+        {
+            continue;
+        }
+        if (headless)
+        {
+            json_begin(entry.op == PRESENCE_JOIN ? "join" : "leave");
+            json_string("user", entry.userID, strlen(entry.userID));
+            json_number("node", entry.node);
+            json_end();
+            continue;
         }
+        format_user(name, sizeof(name), entry.userID, entry.node, 1);
+        append_word(entry.op == PRESENCE_JOIN ? joined : left, name);
+    }
+    for (int i = 0; i < roster_count; i++)
+    {
+        total += roster[i].sessions;
     }
+    pthread_mutex_unlock(&roster_mutex);
 
-    client_running = 0;                 // Signal receive thread to exit
-    pthread_join(receive_thread, NULL); // Wait for receive thread to finish
+    if ((hdr->flags & FRAME_FLAG_SNAPSHOT) && (hdr->flags & FRAME_FLAG_MORE))
+    {
+        return;
+    }
+    if ((hdr->flags & FRAME_FLAG_SNAPSHOT) && headless)
+    {
+        show_roster();
+        return;
+    }
+    if (hdr->flags & FRAME_FLAG_SNAPSHOT)
+    {
+        char notice[64];
+        snprintf(notice, sizeof(notice), "%d user(s) online, /who lists them.", total);
+        display_system(notice);
+        return;
+    }
+    if (strlen(joined) > 7)
+    {
+        display_system(joined);
+    }
+    if (strlen(left) > 5)
+    {
+        display_system(left);
+    }
+}
 
-    // Cleanup ncurses windows and end curses mode
-    delwin(msg_win);
-    delwin(chat_win);
-    endwin();
+/* Writes the roster as one JSON line: {"type":"roster","users":[...]} */
+static void json_roster(void)
+{
+    pthread_mutex_lock(&roster_mutex);
+    json_begin("roster");
+    fputs(",\"users\":[", json_out);
+    for (int i = 0; i < roster_count; i++)
+    {
+        fputs(i == 0 ? "{\"user\":" : ",{\"user\":", json_out);
+        json_quote(roster[i].userID, strlen(roster[i].userID));
+        fprintf(json_out, ",\"node\":%u,\"sessions\":%d}", roster[i].node, roster[i].sessions);
+    }
+    fputs("]", json_out);
+    json_end();
+    pthread_mutex_unlock(&roster_mutex);
+}
 
-    // Close the socket
-    close(sock);
+/* Displays the roster for /who */
+void show_roster(void)
+{
+    char notice[NOTICE_SIZE * 4];
+    char name[16];
 
-    return 0;
+    if (!(session_caps & FRAME_CAP_PRESENCE))
+    {
+        display_system("The server does not report presence.");
+        return;
+    }
+    if (headless)
+    {
+        json_roster();
+        return;
+    }
+    pthread_mutex_lock(&roster_mutex);
+    int n = snprintf(notice, sizeof(notice), "Online (%d):", roster_count);
+    for (int i = 0; i < roster_count && n < (int)sizeof(notice); i++)
+    {
+        format_user(name, sizeof(name), roster[i].userID, roster[i].node, roster[i].sessions);
+        n += snprintf(notice + n, sizeof(notice) - n, " %s", name);
+    }
+    pthread_mutex_unlock(&roster_mutex);
+    display_system(notice);
+}
+
+/* Finds the reassembly slot for a stream, or NULL if none is open */
+static PendingMessage *find_pending(uint32_t stream)
+{
+    for (int i = 0; i < MAX_PENDING; i++)
+    {
+        if (pending[i].stream == stream)
+        {
+            return &pending[i];
+        }
+    }
+    return NULL;
+}
+
+/* Releases a reassembly slot */
+static void drop_pending(PendingMessage *msg)
+{
+    free(msg->text);
+    memset(msg, 0, sizeof(*msg));
+}
+
+/* Appends a chunk, marking the message truncated past max_message */
+static void append_pending(PendingMessage *msg, const char *chunk, size_t length)
+{
+    if (msg->truncated || msg->length + length > max_message)
+    {
+        msg->truncated = 1;
+        return;
+    }
+    char *grown = realloc(msg->text, msg->length + length);
+    if (grown == NULL)
+    {
+        msg->truncated = 1;
+        return;
+    }
+    msg->text = grown;
+    memcpy(msg->text + msg->length, chunk, length);
+    msg->length += length;
 }
 
 /**
- * Receives messages from server in a dedicated thread
- * 
- * Continuously monitors socket for incoming data using poll()
- * Handles:
- * - Server disconnections
- * - Message formatting with timestamps
- * - Updating message display window
- * - Automatic window scrolling and content management
- * 
- * @param socket_ptr Pointer to client socket file descriptor
- * @return NULL when thread exits
+ * Shows a delivered message: window lines, or one JSON line when headless
+ * @param head Sender and stamp from the head frame
+ * @param direct Direct message, outside the room sequence
+ * @param text Message text (not necessarily NUL-terminated)
+ * @param length Message length in bytes
+ * @param truncated Exceeded max_message, only the start is shown
  */
-void *receive_messages(void *socket_ptr)
+static void show_delivery(const DeliverHead *head, int direct, const char *text, size_t length,
+                          int truncated)
 {
-    int sock = *((int *)socket_ptr);
-    char buffer[BUFFER_SIZE] = {0}; // Initialize buffer
-    time_t rawtime;
-    struct tm timeinfo;
-    char timestamp[20];
+    char sender_ip[INET_ADDRSTRLEN];
+    char label[LABEL_SIZE];
+    time_t sent_at = (time_t)(head->stamp.timestamp_ms / 1000);
 
-    struct pollfd pfd = {
-        .fd = sock,
-        .events = POLLIN | POLLERR | POLLHUP // Monitor for data/errors
-    };
+    inet_ntop(AF_INET, &head->addr, sender_ip, INET_ADDRSTRLEN);
+    if (headless)
+    {
+        json_begin(direct ? "direct" : "message");
+        json_string("from", head->userID, strlen(head->userID));
+        json_string("ip", sender_ip, strlen(sender_ip));
+        if (!direct)
+        {
+            json_number("seq", head->stamp.seq);
+        }
+        json_number("ts", head->stamp.timestamp_ms);
+        json_string("text", text, length);
+        if (truncated)
+        {
+            fputs(",\"truncated\":true", json_out);
+        }
+        json_end();
+        return;
+    }
+    snprintf(label, LABEL_SIZE, "%-15s [%-5s] %s ", sender_ip, head->userID, direct ? "<@" : "<<");
+    display_message(label, text, length, sent_at);
+    if (truncated)
+    {
+        display_message(label, "[message truncated]", 19, sent_at);
+    }
+}
 
-    while (client_running)
+/**
+ * Handles one FRAME_DELIVER frame
+ *
+ * Single-chunk messages are displayed straight from the receive buffer;
+ * streamed ones are accumulated per sender until the final chunk arrives.
+ *
+ * @param hdr Decoded frame header
+ * @param payload Frame payload (hdr->length bytes)
+ */
+static void handle_delivery(const FrameHeader *hdr, char *payload)
+{
+    PendingMessage *msg = find_pending(hdr->stream);
+    const char *text = payload;
+    size_t length = hdr->length;
+    DeliverHead head;
+
+    if (hdr->flags & FRAME_FLAG_ABORT)
     {
-        // Clear buffer
-        memset(buffer, 0, BUFFER_SIZE);
-        int ret = poll(&pfd, 1, 100); // 100ms timeout
-        if (ret < 0)
+        if (msg != NULL)
         {
-            perror("poll failed");
-            client_running = 0;
-            break;
+            drop_pending(msg);
         }
-        else if (ret == 0)
+        return;
+    }
+
+    if (hdr->flags & FRAME_FLAG_DIRECT)
+    {
+        // Direct messages are single frames and carry no room seq
+        if (decode_deliver_head((unsigned char *)payload, length, &head) == 0)
         {
-            continue; // Timeout - check again
+            show_delivery(&head, 1, payload + DELIVER_HEAD_SIZE, length - DELIVER_HEAD_SIZE, 0);
         }
+        return;
+    }
 
-        // Handle errors/hangups
-        if (pfd.revents & (POLLERR | POLLHUP))
+    if (hdr->flags & FRAME_FLAG_HEAD)
+    {
+        if (decode_deliver_head((unsigned char *)payload, length, &head) < 0)
         {
-            client_running = 0;
-            break;
+            return; // Malformed head
         }
+        note_seq(&head.stamp);
+        text = payload + DELIVER_HEAD_SIZE;
+        length -= DELIVER_HEAD_SIZE;
 
-        // Handle incoming data
-        if (pfd.revents & POLLIN)
+        if (msg != NULL)
+        {
+            drop_pending(msg); // Previous message from this sender never finished
+        }
+        if (!(hdr->flags & FRAME_FLAG_MORE))
         {
-            ssize_t valread = recv(sock, buffer, BUFFER_SIZE, 0);
-            // Get current time
-            time(&rawtime);
-            localtime_r(&rawtime, &timeinfo);
-            strftime(timestamp, sizeof(timestamp), "(%H:%M:%S)", &timeinfo);
+            show_delivery(&head, 0, text, length, 0);
+            return;
+        }
+        msg = find_pending(0);
+        if (msg == NULL)
+        {
+            return; // Too many concurrent streams, drop this one
+        }
+        msg->stream = hdr->stream;
+        msg->head = head;
+    }
+    else if (msg == NULL)
+    {
+        return; // Joined mid-message, the head was never seen
+    }
+
+    append_pending(msg, text, length);
+    if (!(hdr->flags & FRAME_FLAG_MORE))
+    {
+        show_delivery(&msg->head, 0, msg->text, msg->length, msg->truncated);
+        drop_pending(msg);
+    }
+}
 
-            if (valread <= 0)
-            { // Connection closed or error
+/**
+ * Receives messages from server in a dedicated thread
+ * 
+ * Reads whatever has arrived into a receive buffer and decodes every
+ * whole frame in it; waits (socket poll() or shared-memory ring) only
+ * when a read finds nothing
+ * Handles:
+ * - Server disconnections
+ * - Frame decoding and reassembly of streamed messages
+ * - Updating message display window
+ * 
+ * @param conn_ptr Pointer to the server connection
+ * @return NULL when thread exits
+ */
+void *receive_messages(void *conn_ptr)
+{
+    Conn *conn = conn_ptr;
+    static unsigned char received[RECV_BUFFER_SIZE];
+    static char buffer[FRAME_MAX_PAYLOAD + 1];
+    static char inflated[FRAME_MAX_PAYLOAD + 1];
+    size_t start = 0, end = 0; // Undecoded bytes are received[start..end)
+    FrameHeader hdr;
+
+    while (client_running)
+    {
+        size_t have = end - start;
+        if (have >= FRAME_HEADER_SIZE)
+        {
+            decode_frame_header(received + start, &hdr);
+            if (hdr.length > FRAME_MAX_PAYLOAD)
+            { // Corrupt stream, there is no next frame to resync on
                 client_running = 0;
-                char serverDownMessage[DISPLAY_MESSAGE_SIZE];
-                snprintf(serverDownMessage, DISPLAY_MESSAGE_SIZE,
-                         "%-15s [ sys ] << %-40s %s",
-                         server_ip,
-                         "Server is down.",
-                         timestamp);
-                display_win(msg_win, serverDownMessage, row, shouldBlank);
-                row++;
-                // wgetch(msg_win); // Wait for any key press;
+                if (!closing)
+                {
+                    display_system("Server is down.");
+                }
                 break;
             }
-            if (valread > 0)
+        }
+        if (have < FRAME_HEADER_SIZE || have < FRAME_HEADER_SIZE + hdr.length)
+        {
+            // Partial frame: move it to the front and read more behind it
+            memmove(received, received + start, have);
+            start = 0;
+            end = have;
+            ssize_t n = conn_read_nowait(conn, received + end, sizeof(received) - end);
+            if (n > 0)
+            {
+                end += (size_t)n;
+                continue;
+            }
+            int ret = 0;
+            if (n == 0)
             {
-
-                char message[DISPLAY_MESSAGE_SIZE];
-                snprintf(message, DISPLAY_MESSAGE_SIZE, "%s %s", buffer, timestamp);
-
-                // Display message and increment row
-                display_win(msg_win, message, row, shouldBlank);
-                row++;
-
-                // Reset row if exceeding window height???
-                int max_row;
-                // getmaxyx(msg_win, max_row, NULL);
-                if (row >= max_row - 1)
-                {                    // -1 to account for borders
-                    row = 1;         // Reset to top row
-                    shouldBlank = 1; // Optional: Clear window when resetting
+                if (headless)
+                {
+                    fflush(json_out); // Caught up: hand the batch over before waiting
                 }
+                ret = conn_poll(conn, 100); // 100ms timeout
             }
+            if (n < 0 || ret < 0)
+            { // Hangup or error
+                client_running = 0;
+                if (!closing)
+                {
+                    display_system("Server is down.");
+                }
+                break;
+            }
+            continue; // Readable or timed out - try again
+        }
+
+        const char *body = (const char *)received + start + FRAME_HEADER_SIZE;
+        start += FRAME_HEADER_SIZE + hdr.length;
+        char *payload = buffer;
+        if (hdr.flags & FRAME_FLAG_DEFLATE)
+        {
+            long n = decompress_payload(body, hdr.length, inflated, FRAME_MAX_PAYLOAD);
+            if (n < 0)
+            {
+                continue; // Corrupt frame, nothing sensible to show
+            }
+            payload = inflated;
+            hdr.length = (uint32_t)n;
+        }
+        else
+        {
+            memcpy(buffer, body, hdr.length); // Room for the terminator
+        }
+        payload[hdr.length] = '\0';
+
+        if (hdr.type == FRAME_DELIVER)
+        {
+            handle_delivery(&hdr, payload);
+        }
+        else if (hdr.type == FRAME_ACK)
+        {
+            handle_ack(payload, hdr.length);
+        }
+        else if (hdr.type == FRAME_THROTTLE)
+        {
+            handle_throttle(payload, hdr.length);
+        }
+        else if (hdr.type == FRAME_PRESENCE)
+        {
+            handle_presence(&hdr, payload);
+        }
+        else if (hdr.type == FRAME_ERROR && headless)
+        {
+            json_begin("error");
+            json_string("text", payload, hdr.length);
+            json_end();
+        }
+        else if (hdr.type == FRAME_ERROR)
+        {
+            display_system(payload);
         }
     }
     client_running = 0;
+    if (headless && !closing)
+    {
+        // The input thread may sit in getline() indefinitely; nothing it
+        // could still read can be sent anyway
+        fflush(json_out);
+        exit(EXIT_FAILURE);
+    }
     return NULL;
 }
 
 /* This function is for taking input chars from the user */
-void input_win(WINDOW *win, char *word)
+void input_win(WINDOW *win, char *word, size_t limit)
 {
-    int i = 0, ch;
+    size_t i = 0;
+    int ch;
     int maxrow, maxcol, row = 1, col = 4;
 
     getmaxyx(win, maxrow, maxcol); /* get window size */
-    memset(word, 0, MESSAGE_SIZE); // Clear previous input
+    (void)maxrow;
+    word[0] = '\0'; // Clear previous input
     // Preserve prompt during input
     mvwprintw(win, 1, 1, ">> "); // Explicitly draw prompt
     wmove(win, row, col);        // Start input after prompt
     wrefresh(win);
-    // Read input character-by-character
+    // Read input character-by-character; past the window edge input is
+    // still accepted (e.g. pasted text) but no longer echoed
     while ((ch = wgetch(win)) != '\n' && ch != KEY_ENTER)
     {
         if ((ch == KEY_BACKSPACE || ch == 127) && i > 0)
         {
             // Handle backspace
             i--;
-            col--;
+            if ((int)i < maxcol - 5)
+            {
+                col--;
 
-            // Overwrite character with space (instead of deleting)
-            mvwaddch(win, row, col, ' ');
-            wmove(win, row, col); // Move cursor back
+                // Overwrite character with space (instead of deleting)
+                mvwaddch(win, row, col, ' ');
+                wmove(win, row, col); // Move cursor back
+            }
         }
-        else if (isprint(ch) && col < maxcol - 1)
+        else if (isprint(ch))
         {
-            if (i < MESSAGE_SIZE - 1)
+            if (i < limit)
             {
                 word[i++] = ch;
-                waddch(win, ch);
-                col++;
+                if (col < maxcol - 1)
+                {
+                    waddch(win, ch);
+                    col++;
+                }
             }
             else
             {
@@ -452,6 +1435,70 @@ void input_win(WINDOW *win, char *word)
     word[i] = '\0'; // Null-terminate
 } /* input_win */
 
+/**
+ * Displays a message in SINGLE_MESSAGE_SIZE-character lines
+ *
+ * Each line is "<label><chunk> (HH:MM:SS)"; the window wraps back to the
+ * top once it is full. Safe to call from both threads.
+ *
+ * @param label Sender label, already padded
+ * @param text Message text (not necessarily NUL-terminated)
+ * @param length Message length in bytes
+ * @param when Time the message was sent
+ */
+void display_message(const char *label, const char *text, size_t length, time_t when)
+{
+    static char timestamp[20];      // Formatted cached_when, guarded by display_mutex
+    static time_t cached_when = -1;
+    struct tm timeinfo;
+    int max_row, max_col;
+
+    pthread_mutex_lock(&display_mutex);
+    // Bursts share a second, so localtime_r only runs when it changes
+    if (when != cached_when)
+    {
+        localtime_r(&when, &timeinfo);
+        strftime(timestamp, sizeof(timestamp), "(%H:%M:%S)", &timeinfo);
+        cached_when = when;
+    }
+    getmaxyx(msg_win, max_row, max_col);
+    (void)max_col;
+    size_t offset = 0;
+    do
+    {
+        int chunk = length - offset > SINGLE_MESSAGE_SIZE ? SINGLE_MESSAGE_SIZE : (int)(length - offset);
+        char line[DISPLAY_MESSAGE_SIZE];
+        snprintf(line, DISPLAY_MESSAGE_SIZE, "%s%-40.*s %s", label, chunk, text + offset, timestamp);
+        display_win(msg_win, line, row, shouldBlank);
+        shouldBlank = 0;
+        row++;
+
+        // Reset row when the window is full (-2 accounts for borders)
+        if (row >= max_row - 2)
+        {
+            row = 0;
+            shouldBlank = 1;
+        }
+        offset += chunk;
+    } while (offset < length);
+    pthread_mutex_unlock(&display_mutex);
+}
+
+/* Displays a system notice attributed to the server */
+void display_system(const char *text)
+{
+    if (headless)
+    {
+        json_begin("system");
+        json_string("text", text, strlen(text));
+        json_end();
+        return;
+    }
+    char label[LABEL_SIZE];
+    snprintf(label, LABEL_SIZE, "%-15s [ sys ] << ", server_ip);
+    display_message(label, text, strlen(text), time(NULL));
+}
+
 // display the word to window
 void display_win(WINDOW *win, char *word, int whichRow, int shouldBlank)
 {
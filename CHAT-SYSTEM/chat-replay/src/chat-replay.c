@@ -0,0 +1,542 @@
+/*
+ * File: chat-replay.c
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Replays a chat-server --capture file against live servers
+ *              and reports latency and throughput
+ * Replay: every captured connection is reopened over TCP and sends its
+ *         HELLO and frames byte for byte, each at its captured offset
+ *         divided by --speed (0 sends back to back). One thread sends on
+ *         schedule, another reads everything the servers send back.
+ *         A BYE waits until every message sent so far is acknowledged:
+ *         the server acknowledges and fans out under one lock, so a
+ *         compressed replay cannot hang up a receiver before a message
+ *         that was sent earlier reaches it. Likewise a new connection
+ *         is only used once its WELCOME is in, so it is registered before
+ *         the next captured message is broadcast.
+ * Measurement: latency runs from sending the first chunk of a room
+ *              message to its FRAME_ACK, which the server writes after
+ *              reading, locking and stamping the message and just before
+ *              the fan-out. Throughput counts FRAME_DELIVER frames received
+ *              by all replayed connections, which includes the fan-out.
+ * Compare: with two --target options the capture is replayed against each
+ *          in turn and the second is reported relative to the first.
+ *          Rate limits on the targets show up as throttled messages;
+ *          start them with --rate0 --iprate0 to measure raw capacity.
+ * Usage: ./chat-replay --file<capture> [--target<host>:<port>]... [--speed<x>]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "chat-protocol.h"
+#include "chat-capture.h"
+
+#define MAX_TARGETS 2
+#define DRAIN_TIMEOUT_MS 5000   // Wait for late replies after the last frame
+#define POLL_INTERVAL_MS 10     // Receiver rescans for new connections
+
+/* Replay connection states */
+enum {
+    REPLAY_OPEN = 1,    // sending captured frames
+    REPLAY_CLOSING,     // BYE sent, reading until the server hangs up
+    REPLAY_DONE         // hung up or failed; fd closed after the run
+};
+
+/* One captured connection being replayed */
+typedef struct {
+    Conn conn;
+    int state;                  // REPLAY_* (guarded by Replay.mutex)
+    int welcomed;               // WELCOME received (guarded by Replay.mutex)
+    int in_message;             // Last TEXT frame carried FRAME_FLAG_MORE
+    uint64_t *pending;          // Send times of messages awaiting an ACK
+    size_t pending_head;        //   (FIFO, guarded by Replay.mutex)
+    size_t pending_len;
+    size_t pending_cap;
+} ReplayConn;
+
+/* Results of one replay */
+typedef struct {
+    uint64_t connections;
+    uint64_t frames_sent;
+    uint64_t messages_sent;     // Room messages (first chunks)
+    uint64_t acked;
+    uint64_t throttled;
+    uint64_t errors;
+    uint64_t deliveries;        // FRAME_DELIVER frames received
+    uint64_t first_send_ns;
+    uint64_t last_reply_ns;
+    uint64_t *latency_ns;       // One sample per ACK
+    size_t latency_cap;
+} ReplayStats;
+
+/* State shared by the sender and receiver of one replay */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t acked;       // Signalled when outstanding drops to 0
+                                //   and on every WELCOME or hangup
+    uint64_t outstanding;       // Messages sent and not yet answered
+    ReplayConn **conns;         // Indexed by capture connection number
+    uint32_t conn_cap;
+    int live;                   // Connections not yet DONE
+    int stopping;               // Sender finished, drain then exit
+    uint64_t drain_deadline_ns;
+    ReplayStats stats;
+} Replay;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* Sleeps until the monotonic time due_ns */
+static void sleep_until(uint64_t due_ns) {
+    struct timespec due = { due_ns / 1000000000ull, due_ns % 1000000000ull };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+    }
+}
+
+/**
+ * Opens a TCP connection to host:port
+ * @return socket, or -1 after printing the error
+ */
+static int dial(const char *host, const char *port) {
+    struct addrinfo hints, *res;
+    int fd = -1, one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        fprintf(stderr, "Cannot resolve %s\n", host);
+        return -1;
+    }
+    fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        perror("Connect failed");
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    // Measure the server, not Nagle's algorithm on back-to-back frames
+    if (fd >= 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/* Takes the oldest unacknowledged send time; caller holds run->mutex */
+static int pending_pop(Replay *run, ReplayConn *rc, uint64_t *sent_ns) {
+    if (rc->pending_len == 0) return -1;
+    *sent_ns = rc->pending[rc->pending_head];
+    rc->pending_head = (rc->pending_head + 1) % rc->pending_cap;
+    rc->pending_len--;
+    if (--run->outstanding == 0) pthread_cond_broadcast(&run->acked);
+    return 0;
+}
+
+/* Queues a send time; caller holds run->mutex */
+static void pending_push(Replay *run, ReplayConn *rc, uint64_t sent_ns) {
+    if (rc->pending_len == rc->pending_cap) {
+        size_t cap = rc->pending_cap ? rc->pending_cap * 2 : 64;
+        uint64_t *grown = malloc(cap * sizeof(uint64_t));
+        for (size_t i = 0; i < rc->pending_len; i++) {
+            grown[i] = rc->pending[(rc->pending_head + i) % rc->pending_cap];
+        }
+        free(rc->pending);
+        rc->pending = grown;
+        rc->pending_head = 0;
+        rc->pending_cap = cap;
+    }
+    rc->pending[(rc->pending_head + rc->pending_len) % rc->pending_cap] = sent_ns;
+    rc->pending_len++;
+    run->outstanding++;
+}
+
+/* Waits until every message sent is answered, or the drain timeout;
+ * caller holds run->mutex */
+static void wait_acked(Replay *run) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DRAIN_TIMEOUT_MS / 1000;
+    while (run->outstanding > 0 &&
+           pthread_cond_timedwait(&run->acked, &run->mutex, &deadline) != ETIMEDOUT) {
+    }
+}
+
+/* Waits until the server welcomed rc or hung up; caller holds run->mutex */
+static void wait_welcomed(Replay *run, ReplayConn *rc) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DRAIN_TIMEOUT_MS / 1000;
+    while (!rc->welcomed && rc->state != REPLAY_DONE &&
+           pthread_cond_timedwait(&run->acked, &run->mutex, &deadline) != ETIMEDOUT) {
+    }
+}
+
+/* Marks a connection finished; its unanswered messages never will be;
+ * caller holds run->mutex */
+static void finish_conn(Replay *run, ReplayConn *rc) {
+    uint64_t sent_ns;
+    while (pending_pop(run, rc, &sent_ns) == 0) {
+    }
+    if (rc->state != REPLAY_DONE) {
+        rc->state = REPLAY_DONE;
+        run->live--;
+        pthread_cond_broadcast(&run->acked);
+    }
+}
+
+/* Records one ACK latency sample; caller holds run->mutex */
+static void add_latency(ReplayStats *stats, uint64_t ns) {
+    if (stats->acked == stats->latency_cap) {
+        stats->latency_cap = stats->latency_cap ? stats->latency_cap * 2 : 4096;
+        stats->latency_ns = realloc(stats->latency_ns, stats->latency_cap * sizeof(uint64_t));
+    }
+    stats->latency_ns[stats->acked++] = ns;
+}
+
+/**
+ * Reads and accounts one frame from a replayed connection
+ * @return 0 on success, -1 when the connection is finished
+ */
+static int receive_frame(Replay *run, ReplayConn *rc) {
+    static unsigned char payload[FRAME_MAX_PAYLOAD];
+    FrameHeader hdr;
+    uint64_t sent_ns;
+
+    if (read_frame_header(&rc->conn, &hdr) < 0 || read_full(&rc->conn, payload, hdr.length) < 0) {
+        return -1;
+    }
+    uint64_t now = now_ns();
+
+    pthread_mutex_lock(&run->mutex);
+    run->stats.last_reply_ns = now;
+    switch (hdr.type) {
+    case FRAME_WELCOME:
+        rc->welcomed = 1;
+        pthread_cond_broadcast(&run->acked);
+        break;
+    case FRAME_ACK:
+        if (pending_pop(run, rc, &sent_ns) == 0) add_latency(&run->stats, now - sent_ns);
+        break;
+    case FRAME_THROTTLE:
+        run->stats.throttled++;
+        pending_pop(run, rc, &sent_ns);
+        break;
+    case FRAME_ERROR:
+        // Only an oversized room message ends without an ACK
+        run->stats.errors++;
+        if (hdr.length >= 17 && memcmp(payload, "Message too large", 17) == 0) {
+            pending_pop(run, rc, &sent_ns);
+        }
+        break;
+    case FRAME_DELIVER:
+        run->stats.deliveries++;
+        break;
+    }
+    pthread_mutex_unlock(&run->mutex);
+    return 0;
+}
+
+/* Receiver thread: reads every replayed connection until the run drains */
+static void *receive_loop(void *arg) {
+    Replay *run = arg;
+    struct pollfd *pfds = NULL;
+    ReplayConn **polled = NULL;
+    size_t cap = 0;
+
+    for (;;) {
+        size_t n = 0;
+
+        pthread_mutex_lock(&run->mutex);
+        if (run->stopping && (run->live == 0 || now_ns() >= run->drain_deadline_ns)) {
+            for (uint32_t i = 0; i < run->conn_cap; i++) {
+                if (run->conns[i] != NULL) finish_conn(run, run->conns[i]);
+            }
+            pthread_mutex_unlock(&run->mutex);
+            break;
+        }
+        if (cap < run->conn_cap) {
+            cap = run->conn_cap;
+            pfds = realloc(pfds, cap * sizeof(*pfds));
+            polled = realloc(polled, cap * sizeof(*polled));
+        }
+        for (uint32_t i = 0; i < run->conn_cap; i++) {
+            ReplayConn *rc = run->conns[i];
+            if (rc != NULL && rc->state != REPLAY_DONE) {
+                pfds[n].fd = rc->conn.fd;
+                pfds[n].events = POLLIN;
+                polled[n++] = rc;
+            }
+        }
+        pthread_mutex_unlock(&run->mutex);
+
+        if (poll(pfds, n, POLL_INTERVAL_MS) <= 0) continue;
+        for (size_t i = 0; i < n; i++) {
+            if (pfds[i].revents == 0) continue;
+            if (receive_frame(run, polled[i]) < 0) {
+                pthread_mutex_lock(&run->mutex);
+                finish_conn(run, polled[i]);
+                pthread_mutex_unlock(&run->mutex);
+            }
+        }
+    }
+    free(pfds);
+    free(polled);
+    return NULL;
+}
+
+/* Returns the replay connection for a capture number, growing the table */
+static ReplayConn **conn_slot(Replay *run, uint32_t id) {
+    pthread_mutex_lock(&run->mutex);
+    if (id >= run->conn_cap) {
+        uint32_t cap = run->conn_cap ? run->conn_cap : 64;
+        while (cap <= id) cap *= 2;
+        run->conns = realloc(run->conns, cap * sizeof(ReplayConn *));
+        memset(run->conns + run->conn_cap, 0, (cap - run->conn_cap) * sizeof(ReplayConn *));
+        run->conn_cap = cap;
+    }
+    ReplayConn **slot = &run->conns[id];
+    pthread_mutex_unlock(&run->mutex);
+    return slot;
+}
+
+/**
+ * Acts on one capture record
+ * Only the sender thread writes to the sockets; it never blocks on the
+ * mutex for longer than a table update
+ */
+static void replay_record(Replay *run, const CaptureRecord *record, const unsigned char *payload,
+                          const char *host, const char *port) {
+    ReplayConn **slot = conn_slot(run, record->conn);
+    ReplayConn *rc = *slot;
+    uint64_t now = now_ns();
+
+    if (record->kind == CAPTURE_OPEN) {
+        if (rc != NULL) return;     // Duplicate number, corrupt capture
+        int fd = dial(host, port);
+        if (fd < 0) return;
+        rc = calloc(1, sizeof(*rc));
+        conn_init(&rc->conn, fd);
+        rc->state = REPLAY_OPEN;
+        // Same-host rings cannot be replayed over TCP
+        send_frame(&rc->conn, FRAME_HELLO, record->hdr.flags & ~FRAME_CAP_SHM,
+                   record->hdr.stream, payload, record->hdr.length);
+        pthread_mutex_lock(&run->mutex);
+        *slot = rc;
+        run->live++;
+        run->stats.connections++;
+        wait_welcomed(run, rc);
+        pthread_mutex_unlock(&run->mutex);
+        return;
+    }
+
+    pthread_mutex_lock(&run->mutex);
+    int state = rc != NULL ? rc->state : REPLAY_DONE;
+    if (state == REPLAY_OPEN && record->kind == CAPTURE_CLOSE) {
+        wait_acked(run);
+        rc->state = REPLAY_CLOSING;
+    }
+    if (state == REPLAY_OPEN && record->kind == CAPTURE_FRAME && record->hdr.type == FRAME_TEXT) {
+        if (!rc->in_message) {
+            pending_push(run, rc, now);
+            run->stats.messages_sent++;
+        }
+        rc->in_message = (record->hdr.flags & FRAME_FLAG_MORE) != 0;
+    }
+    pthread_mutex_unlock(&run->mutex);
+    if (state != REPLAY_OPEN) return;
+
+    if (record->kind == CAPTURE_CLOSE) {
+        send_frame(&rc->conn, FRAME_BYE, 0, 0, NULL, 0);
+        return;
+    }
+    if (run->stats.first_send_ns == 0) run->stats.first_send_ns = now;
+    send_frame(&rc->conn, record->hdr.type, record->hdr.flags, record->hdr.stream,
+               payload, record->hdr.length);
+    run->stats.frames_sent++;
+}
+
+/**
+ * Replays the whole capture against one target
+ * @param target "host:port" (port defaults to PORT)
+ * @param speed Time scale, 0 = as fast as possible
+ * @return 0 on success, -1 if the capture is unreadable
+ */
+static int replay(const char *path, const char *target, double speed, ReplayStats *stats) {
+    static unsigned char payload[FRAME_MAX_PAYLOAD];
+    char host[256], port[8];
+    const char *colon = strrchr(target, ':');
+    CaptureRecord record;
+    Replay run;
+    pthread_t receiver;
+    int rc;
+
+    if (colon != NULL) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - target), target);
+        snprintf(port, sizeof(port), "%s", colon + 1);
+    } else {
+        snprintf(host, sizeof(host), "%s", target);
+        snprintf(port, sizeof(port), "%d", PORT);
+    }
+    FILE *fp = capture_open(path);
+    if (fp == NULL) {
+        fprintf(stderr, "%s is not a readable capture\n", path);
+        return -1;
+    }
+
+    memset(&run, 0, sizeof(run));
+    pthread_mutex_init(&run.mutex, NULL);
+    pthread_cond_init(&run.acked, NULL);
+    pthread_create(&receiver, NULL, receive_loop, &run);
+
+    uint64_t start = now_ns();
+    while ((rc = capture_read(fp, &record, payload, sizeof(payload))) == 1) {
+        if (speed > 0) sleep_until(start + (uint64_t)(record.time_us * 1000.0 / speed));
+        replay_record(&run, &record, payload, host, port);
+    }
+    fclose(fp);
+    if (rc < 0) fprintf(stderr, "Warning: capture is truncated, replayed what was readable\n");
+
+    // Connections still open at the end of the capture say goodbye too
+    pthread_mutex_lock(&run.mutex);
+    wait_acked(&run);
+    for (uint32_t i = 0; i < run.conn_cap; i++) {
+        ReplayConn *c = run.conns[i];
+        if (c != NULL && c->state == REPLAY_OPEN) {
+            c->state = REPLAY_CLOSING;
+            send_frame(&c->conn, FRAME_BYE, 0, 0, NULL, 0);
+        }
+    }
+    run.drain_deadline_ns = now_ns() + DRAIN_TIMEOUT_MS * 1000000ull;
+    run.stopping = 1;
+    pthread_mutex_unlock(&run.mutex);
+    pthread_join(receiver, NULL);
+
+    for (uint32_t i = 0; i < run.conn_cap; i++) {
+        if (run.conns[i] != NULL) {
+            conn_close(&run.conns[i]->conn);
+            free(run.conns[i]->pending);
+            free(run.conns[i]);
+        }
+    }
+    free(run.conns);
+    pthread_mutex_destroy(&run.mutex);
+    pthread_cond_destroy(&run.acked);
+    *stats = run.stats;
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Latency at the given fraction of the sorted samples, in microseconds */
+static double latency_us(const ReplayStats *stats, double fraction) {
+    if (stats->acked == 0) return 0;
+    size_t i = (size_t)(stats->acked * fraction);
+    if (i >= stats->acked) i = stats->acked - 1;
+    return stats->latency_ns[i] / 1e3;
+}
+
+/* Deliveries per second between the first send and the last reply */
+static double delivery_rate(const ReplayStats *stats) {
+    if (stats->last_reply_ns <= stats->first_send_ns) return 0;
+    return stats->deliveries / ((stats->last_reply_ns - stats->first_send_ns) / 1e9);
+}
+
+/* Prints one report line per metric, one column per target */
+static void report(const char **targets, ReplayStats *stats, int count) {
+    static const char *labels[] = {
+        "connections", "frames sent", "messages sent", "acked", "throttled", "errors",
+        "deliveries", "elapsed ms", "deliveries/s", "ack p50 us", "ack p99 us",
+        "ack p99.9 us", "ack max us"
+    };
+    const int rows = sizeof(labels) / sizeof(labels[0]);
+    double values[MAX_TARGETS][sizeof(labels) / sizeof(labels[0])];
+
+    for (int t = 0; t < count; t++) {
+        ReplayStats *s = &stats[t];
+        qsort(s->latency_ns, s->acked, sizeof(uint64_t), compare_u64);
+        double row[] = {
+            s->connections, s->frames_sent, s->messages_sent, s->acked, s->throttled, s->errors,
+            s->deliveries,
+            s->last_reply_ns > s->first_send_ns ? (s->last_reply_ns - s->first_send_ns) / 1e6 : 0,
+            delivery_rate(s), latency_us(s, 0.50), latency_us(s, 0.99), latency_us(s, 0.999),
+            s->acked > 0 ? s->latency_ns[s->acked - 1] / 1e3 : 0
+        };
+        memcpy(values[t], row, sizeof(row));
+    }
+
+    printf("%-14s", "");
+    for (int t = 0; t < count; t++) printf(" %22s", targets[t]);
+    if (count == 2) printf(" %9s", "change");
+    printf("\n");
+    for (int r = 0; r < rows; r++) {
+        printf("%-14s", labels[r]);
+        for (int t = 0; t < count; t++) printf(" %22.1f", values[t][r]);
+        if (count == 2 && values[0][r] != 0) {
+            printf(" %+8.1f%%", (values[1][r] - values[0][r]) * 100.0 / values[0][r]);
+        }
+        printf("\n");
+    }
+}
+
+/**
+ * Main replay function
+ * Replays the capture against each target in turn, then prints the report
+ */
+int main(int argc, char *argv[]) {
+    const char *path = NULL;
+    const char *targets[MAX_TARGETS];
+    ReplayStats stats[MAX_TARGETS];
+    int target_count = 0;
+    double speed = 1.0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--file", 6) == 0) {
+            path = argv[i] + 6;
+        } else if (strncmp(argv[i], "--target", 8) == 0 && target_count < MAX_TARGETS) {
+            targets[target_count++] = argv[i] + 8;
+        } else if (strncmp(argv[i], "--speed", 7) == 0) {
+            speed = strtod(argv[i] + 7, NULL);
+            if (speed < 0) {
+                fprintf(stderr, "--speed must not be negative\n");
+                return EXIT_FAILURE;
+            }
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (path == NULL || *path == '\0') {
+        printf("Usage: %s --file<capture> [--target<host>:<port>]... [--speed<x>]\n"
+               "  --speed2 replays twice as fast, --speed0 back to back; two --target\n"
+               "  options compare the second server against the first\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (target_count == 0) targets[target_count++] = "127.0.0.1:8080";
+
+    for (int t = 0; t < target_count; t++) {
+        if (speed > 0) printf("Replaying %s against %s at %gx\n", path, targets[t], speed);
+        else printf("Replaying %s against %s back to back\n", path, targets[t]);
+        fflush(stdout);
+        if (replay(path, targets[t], speed, &stats[t]) < 0) return EXIT_FAILURE;
+    }
+    report(targets, stats, target_count);
+    for (int t = 0; t < target_count; t++) free(stats[t].latency_ns);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,34 @@
+/*
+ * File: sdt.h
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Stand-in for systemtap's <sys/sdt.h>, used only by
+ *              "make usdt-check" so the probe branch of chat-trace.h is
+ *              compiled on machines without systemtap-sdt-dev
+ * Probes: each one keeps its "provider:name" in the chat_probes section,
+ *         where the check looks for it, and passes its arguments as "nor"
+ *         asm operands, as the real header does, so an argument it could
+ *         not take fails to compile here too. Nothing fires at run time.
+ */
+
+#ifndef _SYS_SDT_H
+#define _SYS_SDT_H 1
+
+#define CHAT_SDT_NAME(provider, name)                                   \
+    static const char chat_sdt_probe[]                                  \
+        __attribute__((section("chat_probes"), used)) = #provider ":" #name
+
+#define DTRACE_PROBE1(provider, name, a)                                \
+    do {                                                                \
+        CHAT_SDT_NAME(provider, name);                                  \
+        __asm__ __volatile__("" :: "nor"(a));                           \
+    } while (0)
+
+#define DTRACE_PROBE2(provider, name, a, b)                             \
+    do {                                                                \
+        CHAT_SDT_NAME(provider, name);                                  \
+        __asm__ __volatile__("" :: "nor"(a), "nor"(b));                 \
+    } while (0)
+
+#endif /* _SYS_SDT_H */
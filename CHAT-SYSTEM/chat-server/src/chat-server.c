@@ -4,12 +4,42 @@
  * Sp_04
  * Group member: Deyi, Zhizheng
  * Description: Multi-threaded TCP chat server supporting concurrent client connections
- * Features: Client registration, message broadcasting, connection management
- * Protocols: IPv4, TCP socket communication
- * Threading: Uses pthreads for concurrent client handling
- * Limitations: Supports up to 10 concurrent clients (fixed array size)
+ * Features: Client registration, message broadcasting, connection management,
+ *           chunked streaming of large messages (see chat-protocol.h),
+ *           per-connection deflate compression (see chat-compress.h),
+ *           per-session and per-IP token-bucket rate limiting,
+ *           same-host clients over AF_UNIX and shared-memory rings,
+ *           cluster mode: several nodes relay messages over peer links and
+ *           route direct messages through a userID -> node directory,
+ *           TLS with session resumption and kTLS where available,
+ *           per-message lifecycle tracepoints and a sampled per-stage
+ *           latency breakdown (see chat-trace.h),
+ *           pinned network threads (optionally on the CPU that handles
+ *           the connection's receive queue) and opt-in busy polling,
+ *           capture of inbound client traffic for chat-replay,
+ *           presence: roster snapshot on join, then coalesced diffs,
+ *           hot/cold session tables with frame buffers mapped only while
+ *           a session is active; idle plaintext sessions wait in one
+ *           epoll set without a thread of their own
+ * Protocols: IPv4, TCP socket communication, optionally TLS (see chat-tls.h);
+ *            AF_UNIX (see chat-transport.h)
+ * Threading: Uses pthreads for concurrent client handling: a session has a
+ *            thread while it is busy (and for good on TLS, shm and busy
+ *            polling), otherwise the parker thread starts one when input
+ *            arrives; each peer link has a reader and a batching writer thread
+ * Limitations: Supports up to --maxclients (default DEFAULT_MAX_CLIENTS)
+ *              concurrent clients per node, fewer if the open file limit is lower
+ * Usage: ./chat-server [--max<bytes>] [--nocompress] [--rate<msg/s>] [--burst<n>]
+ *                      [--iprate<msg/s>] [--ipburst<n>] [--unix[<path>]] [--shmring<bytes>]
+ *                      [--port<n>] [--node<1-255> [--peer<host>:<port>]...]
+ *                      [--tlscert<file> --tlskey<file> [--tlsca<file>]] [--trace[<n>]]
+ *                      [--cpus<list> [--rxaffinity]] [--busypoll<us>] [--capture<file>]
+ *                      [--maxclients<n>]
+ *        kill -USR1 <pid> prints the server counters, the memory held per
+ *        session (and the --trace latency breakdown of 1 frame in n)
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,158 +47,2069 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <pthread.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <limits.h>
 
-#define PORT 8080
-#define BUFFER_SIZE 40
-#define FORMAT_SIZE 68
+#include "chat-protocol.h"
+#include "chat-compress.h"
+#include "chat-tls.h"
+#include "chat-trace.h"
+#include "chat-capture.h"
 
-/* Client connection information structure */
+#define DEFAULT_MAX_CLIENTS 100000 // Connected clients per node (--maxclients)
+#define FD_RESERVE 64           // Descriptors kept for listeners, peer links and files
+#define IP_BUCKET_SLOTS 256     // Per-IP rate limit table size (power of two)
+#define MAX_PEERS 8             // Peer links per node, dialed and accepted
+#define DIRECTORY_SIZE 256      // Remote users known to this node
+#define RELAY_WINDOW 1024       // Relay seqs per origin tracked for dedup (power of two)
+#define PEER_QUEUE_LIMIT (4 * 1024 * 1024) // Unsent relay bytes before a link is dropped
+#define PEER_RETRY_MS 1000      // Redial interval for --peer links
+#define PRESENCE_TABLE_MIN 1024 // Net changes the presence table is first mapped for
+#define REGISTER_TIMEOUT_MS 10000 // TLS handshake, then HELLO, must arrive within this
+#define SESSION_IDLE_MS 2000    // Quiet time after which a session drops its buffers
+#define SESSION_STACK_SIZE (64 * 1024) // Client handler stack; big buffers live on the heap
+#define PARK_EVENTS 64          // Parked sessions woken per epoll_wait
+
+/* Token bucket: holds up to burst tokens, refilled at rate per second */
+typedef struct {
+    double tokens;              // Tokens currently available
+    uint64_t refilled_ns;       // Monotonic time of the last refill
+} TokenBucket;
+
+/* Rate limit configuration; rate 0 disables the limit */
+typedef struct {
+    double rate;                // Tokens added per second
+    double burst;               // Bucket capacity
+} RateLimit;
+
+/* Per-IP bucket shared by every session from the same address */
+typedef struct {
+    uint32_t addr;              // IPv4 address, network order
+    int sessions;               // Sessions holding this slot, 0 = free
+    TokenBucket bucket;
+} IpBucket;
+
+/* Link to another node; frames are queued under client_list_mutex and
+ * written by the link's own thread, so a slow peer never stalls a lock */
+typedef struct {
+    int active;                 // Slot in use (guarded by client_list_mutex)
+    uint16_t node;              // Remote node id
+    Conn *conn;                 // Connection, owned by the link's reader
+    pthread_mutex_t out_mutex;  // Guards the queue fields below
+    pthread_cond_t out_cond;
+    unsigned char *out;         // Encoded frames waiting for the writer
+    size_t out_len;
+    size_t out_cap;
+    int closing;                // Link is being torn down, queue nothing
+    uint64_t frames;            // Relay frames queued
+    uint64_t batches;           // Writes that carried them
+} PeerLink;
+
+/* Directory entry: where a remote user is connected */
+typedef struct {
+    char userID[USER_ID_SIZE];  // Empty string = free slot
+    uint16_t node;              // Home node of the user
+    int via;                    // Peer link direct messages to the user take
+    unsigned via_mask;          // Every link the user's JOIN arrived on
+} DirEntry;
+
+/* Relayed messages accepted from one origin node: the highest seq and a
+ * bitmap of the RELAY_WINDOW seqs up to it, indexed by seq % RELAY_WINDOW */
+typedef struct {
+    uint32_t boot;
+    uint64_t seq;
+    uint64_t window[RELAY_WINDOW / 64];
+} RelaySeen;
+
+/* Client connection information structure, as session_register() builds
+ * it; add_client() files it into the hot and cold tables */
 typedef struct {
     char ip[INET_ADDRSTRLEN];   // Client IP address
-    char userID[6];             // Client username (max 5 chars + null)
+    uint32_t addr;              // Client IPv4 address, network order
+    char userID[USER_ID_SIZE];  // Client username (max 5 chars + null)
     int socket_fd;              // Client socket descriptor
+    Conn *conn;                 // Transport, owned by the session
+    uint32_t session_id;        // Stream id stamped on this client's deliveries
+    uint8_t caps;               // Negotiated FRAME_CAP_* bits
+    int cpu;                    // CPU the handler thread is pinned to, -1 if not
 } ClientInfo;
 
-/* Global client management variables */
-ClientInfo client_list[10];     // Fixed-size client storage
+/* What every frame looks at: fan-out walks the whole table under
+ * client_list_mutex, so it is kept to a few cache lines (24 bytes each) */
+typedef struct {
+    Conn *conn;                 // Transport, owned by the session
+    int socket_fd;              // Client socket descriptor, the lookup key
+    uint32_t session_id;        // Stream id stamped on this client's deliveries
+    uint8_t streaming;          // Mid-message: head already sent, more chunks due
+    uint8_t caps;               // Negotiated FRAME_CAP_* bits
+} ClientHot;
+
+/* Identity and bookkeeping, read on joins, leaves, presence and stats */
+typedef struct {
+    char ip[INET_ADDRSTRLEN];   // Client IP address
+    char userID[USER_ID_SIZE];  // Client username (max 5 chars + null)
+    int cpu;                    // CPU the handler thread is pinned to, -1 if not
+    uint64_t throttled;         // Messages dropped by the rate limit
+} ClientCold;
+
+/* Receive buffers of one session: mapped on the first frame, unmapped
+ * after SESSION_IDLE_MS without traffic. Untouched pages (inflated, for
+ * a session that never compresses) are never backed */
+typedef struct {
+    char buffer[FRAME_MAX_PAYLOAD + 1];
+    char inflated[FRAME_CHUNK_SIZE];
+} SessionBuffers;
+
+/* One connection, from accept() to close. Everything the message loop
+ * keeps between frames lives here rather than on the handler stack, so a
+ * parked session needs no thread; a slot is reused after the session ends */
+typedef struct Session {
+    Conn conn;                  // Transport; the hot table points here
+    ClientInfo info;            // Filled in by session_register()
+    int registered;             // In the client tables
+    int cpu;                    // CPU for its handler threads, -1 if not pinned
+    unsigned char head_bytes[DELIVER_HEAD_SIZE]; // Sender fields of its deliveries
+    TokenBucket bucket;         // Session rate limit
+    int ip_slot;                // From ip_bucket_attach()
+    uint32_t capture_id;        // From capture_begin()
+    uint32_t message_bytes;     // Bytes accepted so far of the current message
+    int discarding;             // Current message exceeded a limit
+    struct Session *next_free;  // Free list link
+} Session;
+
+/* Global client management variables; entry i of both tables is one client.
+ * The tables are mapped for --maxclients at startup, pages are backed as
+ * the client count grows; client_slot[fd] is the entry of a socket + 1 */
+ClientHot *client_hot;
+ClientCold *client_cold;
+int *client_slot;
+int client_slot_count = 0;      // Descriptors client_slot covers
+int max_clients = DEFAULT_MAX_CLIENTS; // --maxclients, lowered to fit the open file limit
 int client_count = 0;           // Current number of connected clients
 volatile int shutdown_requested = 0; // Server shutdown flag (volatile for cross-thread visibility)
 pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER; // Thread synchronization
+uint32_t next_session_id = 1;   // Session id allocator (guarded by client_list_mutex)
+uint64_t lobby_seq = 0;         // Last seq stamped in ROOM_LOBBY (guarded by client_list_mutex)
+uint32_t max_message_size = DEFAULT_MAX_MESSAGE; // Per-message limit (--max)
+uint8_t server_caps = FRAME_CAP_DEFLATE | FRAME_CAP_SHM | FRAME_CAP_PRESENCE; // Offered to clients
+size_t shm_ring_size = SHM_RING_SIZE;   // Ring bytes per direction (--shmring)
+struct ssl_ctx_st *tls_ctx = NULL;      // Set by --tlscert: TCP clients must use TLS
+struct ssl_ctx_st *peer_tls_ctx = NULL; // Dials --peer links over TLS
+volatile sig_atomic_t stats_requested = 0; // Set by SIGUSR1, served by main loop
+
+/* Thread placement; network threads are pinned before they first run.
+ * Session slots are set up by the accept thread and parked sessions move
+ * between threads, so their memory is not placed on any particular node */
+cpu_set_t network_cpus;             // --cpus, empty = let the scheduler decide
+int network_cpu_count = 0;
+int rx_affinity = 0;                // --rxaffinity: follow SO_INCOMING_CPU
+int busy_poll_us = 0;               // --busypoll, 0 = block at once
+
+/* Traffic capture (--capture); records from all handlers share one file */
+FILE *capture_fp = NULL;            // Guarded by capture_mutex
+pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint64_t capture_start_ns = 0;
+uint32_t capture_conns = 0;         // Connections numbered so far (guarded)
+
+/* Rate limiting: one token per frame, checked before any fan-out */
+RateLimit session_limit = { 20.0, 40.0 };   // --rate / --burst
+RateLimit ip_limit = { 50.0, 100.0 };       // --iprate / --ipburst
+IpBucket ip_buckets[IP_BUCKET_SLOTS];
+pthread_mutex_t ip_bucket_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint64_t throttled_messages = 0;    // Messages dropped (atomic)
+uint64_t throttled_waits = 0;       // Mid-message chunks delayed (atomic)
+uint64_t messages_relayed = 0;      // Messages accepted for broadcast (atomic)
+int buffers_held = 0;               // Sessions holding SessionBuffers (atomic)
+
+/* Session slots: max_clients + MAX_PEERS of them, mapped at startup */
+Session *session_pool;
+int session_pool_size = 0;
+int session_pool_used = 0;          // Slots ever handed out
+Session *session_free = NULL;       // Slots handed back
+pthread_mutex_t session_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+int park_fd = -1;                   // epoll set of sessions waiting without a thread
+int sessions_parked = 0;            // Sessions in park_fd (atomic)
+int handler_threads = 0;            // Running handle_client() threads (atomic)
+long baseline_rss_kib = 0;          // Process RSS when the server started accepting
+
+/* Cluster state; everything but the link queues is guarded by client_list_mutex */
+uint16_t listen_port = PORT;        // --port
+uint16_t node_id = 0;               // --node, 0 = standalone
+uint32_t boot_id;                   // This incarnation, part of every message id
+uint64_t relay_seq = 0;             // Last message id seq issued by this node
+PeerLink peer_links[MAX_PEERS];
+DirEntry directory[DIRECTORY_SIZE];
+RelaySeen relay_seen[MAX_NODE_ID + 1];
+uint64_t relay_accepted = 0;        // Relayed frames taken in
+uint64_t relay_duplicates = 0;      // Relayed frames already seen
+
+/* Net presence change of one user on one node in the current window */
+typedef struct {
+    char userID[USER_ID_SIZE];
+    uint16_t node;
+    int net;                    // Joins minus leaves
+    int unseen;                 // Scratch for presence_base()
+    uint32_t slot;              // Its presence_index slot
+} PresenceChange;
+
+/* Presence changes since the last flush (guarded by client_list_mutex):
+ * one entry per user and node, in order of the first change, found
+ * through an open-addressing index of twice the capacity. Both are
+ * mapped, and grown by presence_grow(), rather than malloc'ed, as session
+ * threads add to them */
+PresenceChange *presence_changes = NULL;
+uint32_t *presence_index = NULL;    // Entry + 1 per slot, 0 = free
+int presence_count = 0;
+int presence_capacity = 0;
+uint64_t presence_window = 0;       // Diffs sent so far; a snapshot is valid within one
+
+/* Returns CLOCK_MONOTONIC_COARSE in nanoseconds */
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* Appends a record under capture_mutex; a failed write ends the capture */
+static void capture_append(CaptureRecord *record, const void *payload) {
+    record->time_us = (trace_clock() - capture_start_ns) / 1000;
+    if (capture_write(capture_fp, record, payload) < 0 ||
+        (record->kind == CAPTURE_CLOSE && fflush(capture_fp) != 0)) {
+        perror("Capture write failed, capture stopped");
+        fclose(capture_fp);
+        capture_fp = NULL;
+    }
+}
+
+/**
+ * Starts capturing a newly registered connection
+ * @param hello The connection's HELLO frame
+ * @return capture connection number, 0 when not capturing
+ */
+static uint32_t capture_begin(const FrameHeader *hello, const void *payload) {
+    CaptureRecord record = { 0, 0, CAPTURE_OPEN, *hello };
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_fp != NULL) {
+        record.conn = ++capture_conns;
+        capture_append(&record, payload);
+    }
+    pthread_mutex_unlock(&capture_mutex);
+    return record.conn;
+}
+
+/**
+ * Records an inbound frame, or the end of a connection (hdr NULL)
+ * @param conn Number from capture_begin(); 0 records nothing
+ */
+static void capture_event(uint32_t conn, const FrameHeader *hdr, const void *payload) {
+    if (conn == 0) return;
+    CaptureRecord record = { 0, conn, hdr != NULL ? CAPTURE_FRAME : CAPTURE_CLOSE, { 0 } };
+    if (hdr != NULL) record.hdr = *hdr;
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_fp != NULL) capture_append(&record, payload);
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+/* Tops a bucket up for the time elapsed since its last refill */
+static void bucket_refill(TokenBucket *bucket, const RateLimit *limit, uint64_t now) {
+    if (now > bucket->refilled_ns) {
+        bucket->tokens += limit->rate * (now - bucket->refilled_ns) / 1e9;
+        if (bucket->tokens > limit->burst) bucket->tokens = limit->burst;
+        bucket->refilled_ns = now;
+    }
+}
+
+/* Milliseconds until a bucket holds one token again */
+static uint32_t bucket_wait_ms(const TokenBucket *bucket, const RateLimit *limit) {
+    if (limit->rate <= 0 || bucket->tokens >= 1.0) return 0;
+    return (uint32_t)((1.0 - bucket->tokens) * 1000.0 / limit->rate) + 1;
+}
+
+/**
+ * Claims the per-IP bucket for a new session
+ * @return slot index, or -1 if the table is full (the IP is then unlimited
+ *         and only the session bucket applies)
+ */
+static int ip_bucket_attach(uint32_t addr) {
+    int free_slot = -1;
+    unsigned start = (addr * 2654435761u) & (IP_BUCKET_SLOTS - 1);
+
+    pthread_mutex_lock(&ip_bucket_mutex);
+    for (unsigned n = 0; n < IP_BUCKET_SLOTS; n++) {
+        int slot = (start + n) & (IP_BUCKET_SLOTS - 1);
+        if (ip_buckets[slot].sessions > 0 && ip_buckets[slot].addr == addr) {
+            ip_buckets[slot].sessions++;
+            pthread_mutex_unlock(&ip_bucket_mutex);
+            return slot;
+        }
+        if (ip_buckets[slot].sessions == 0 && free_slot < 0) free_slot = slot;
+    }
+    if (free_slot >= 0) {
+        ip_buckets[free_slot].addr = addr;
+        ip_buckets[free_slot].sessions = 1;
+        ip_buckets[free_slot].bucket.tokens = ip_limit.burst;
+        ip_buckets[free_slot].bucket.refilled_ns = monotonic_ns();
+    }
+    pthread_mutex_unlock(&ip_bucket_mutex);
+    return free_slot;
+}
+
+/* Releases a slot claimed by ip_bucket_attach() */
+static void ip_bucket_detach(int slot) {
+    if (slot < 0) return;
+    pthread_mutex_lock(&ip_bucket_mutex);
+    ip_buckets[slot].sessions--;
+    pthread_mutex_unlock(&ip_bucket_mutex);
+}
+
+/**
+ * Takes one token from both the session and the IP bucket
+ * @param session Session bucket, owned by the calling thread
+ * @param ip_slot Slot from ip_bucket_attach(), or -1
+ * @return 0 if the frame may pass, otherwise ms until it could; nothing is
+ *         taken unless both buckets have a token
+ */
+static uint32_t rate_limit_take(TokenBucket *session, int ip_slot) {
+    uint64_t now = monotonic_ns();
+    uint32_t wait = 0;
+
+    if (session_limit.rate > 0) {
+        bucket_refill(session, &session_limit, now);
+        wait = bucket_wait_ms(session, &session_limit);
+    }
+    if (ip_slot >= 0 && ip_limit.rate > 0) {
+        pthread_mutex_lock(&ip_bucket_mutex);
+        TokenBucket *shared = &ip_buckets[ip_slot].bucket;
+        bucket_refill(shared, &ip_limit, now);
+        uint32_t ip_wait = bucket_wait_ms(shared, &ip_limit);
+        if (ip_wait > wait) wait = ip_wait;
+        if (wait == 0) shared->tokens -= 1.0;
+        pthread_mutex_unlock(&ip_bucket_mutex);
+    }
+    if (wait == 0 && session_limit.rate > 0) session->tokens -= 1.0;
+    return wait;
+}
+
+/* Signal handler: defer the counter dump to the main loop */
+static void request_stats(int signo) {
+    (void)signo;
+    stats_requested = 1;
+}
+
+/* Resident set size of the process in KiB, 0 if unknown */
+static long resident_kib(void) {
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) return 0;
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(fp);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * Prints what sessions cost; caller holds client_list_mutex
+ * A parked session is its Session slot, its table entries and its
+ * client_slot entry. A session with a handler thread adds that thread's
+ * stack (SESSION_STACK_SIZE reserved, the touched pages resident) and,
+ * while active, a SessionBuffers mapping; TLS sessions add OpenSSL state.
+ * The RSS growth since startup measures all of that and is also shown
+ * per session. Kernel socket buffers, thread structures and epoll
+ * entries are not part of the RSS
+ */
+static void dump_memory(void) {
+    size_t parked = sizeof(Session) + sizeof(ClientHot) + sizeof(ClientCold) + sizeof(int);
+    int held = __atomic_load_n(&buffers_held, __ATOMIC_RELAXED);
+    long rss = resident_kib();
+    size_t shm = 0;
+    int tls = 0;
+
+    for (int i = 0; i < client_count; i++) {
+        shm += client_hot[i].conn->shm_size;
+        tls += client_hot[i].conn->ssl != NULL;
+    }
+    printf("--- memory: %zu B per parked session (%zu session + %zu hot + %zu cold + %zu fd), "
+           "a handler thread adds its stack (%d KiB reserved), an active one %zu B ---\n",
+           parked, sizeof(Session), sizeof(ClientHot), sizeof(ClientCold), sizeof(int),
+           SESSION_STACK_SIZE / 1024, sizeof(SessionBuffers));
+    printf("  %d session(s), %d connection(s) parked, %d handler thread(s), %d active; "
+           "%zu KiB shm rings, %d on TLS\n", client_count,
+           __atomic_load_n(&sessions_parked, __ATOMIC_RELAXED),
+           __atomic_load_n(&handler_threads, __ATOMIC_RELAXED), held, shm / 1024, tls);
+    printf("  process RSS %ld KiB, %+ld KiB since startup", rss, rss - baseline_rss_kib);
+    if (client_count > 0) {
+        printf(" = %ld B per session", (rss - baseline_rss_kib) * 1024 / client_count);
+    }
+    printf("\n");
+}
+
+/* Prints server counters to stdout */
+void dump_stats(void) {
+    pthread_mutex_lock(&client_list_mutex);
+    printf("--- stats: %d client(s), %llu message(s) relayed, %llu throttled, "
+           "%llu chunk(s) delayed ---\n", client_count,
+           (unsigned long long)__atomic_load_n(&messages_relayed, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&throttled_messages, __ATOMIC_RELAXED),
+           (unsigned long long)__atomic_load_n(&throttled_waits, __ATOMIC_RELAXED));
+    for (int i = 0; i < client_count; i++) {
+        printf("  %-5s %-15s throttled %llu", client_cold[i].userID, client_cold[i].ip,
+               (unsigned long long)client_cold[i].throttled);
+        if (client_cold[i].cpu >= 0) printf(", cpu %d", client_cold[i].cpu);
+        printf("\n");
+    }
+    dump_memory();
+    if (node_id != 0) {
+        printf("--- node %u: %llu relayed frame(s) accepted, %llu duplicate(s) ---\n", node_id,
+               (unsigned long long)relay_accepted, (unsigned long long)relay_duplicates);
+        for (int i = 0; i < MAX_PEERS; i++) {
+            PeerLink *link = &peer_links[i];
+            if (!link->active) continue;
+            pthread_mutex_lock(&link->out_mutex);
+            printf("  peer node %-3u %llu frame(s) in %llu write(s)\n", link->node,
+                   (unsigned long long)link->frames, (unsigned long long)link->batches);
+            pthread_mutex_unlock(&link->out_mutex);
+        }
+        for (int i = 0; i < DIRECTORY_SIZE; i++) {
+            if (directory[i].userID[0] != '\0') {
+                printf("  %-5s on node %u\n", directory[i].userID, directory[i].node);
+            }
+        }
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+    if (trace_every != 0) trace_dump(stdout);
+    fflush(stdout);
+}
+
+/**
+ * Parses a CPU list such as "0-3,8,10-11"
+ * @return number of CPUs in the set, -1 on a malformed or empty list
+ */
+static int parse_cpu_list(const char *spec, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*spec != '\0') {
+        char *end;
+        long first = strtol(spec, &end, 10), last = first;
+        if (end == spec) return -1;
+        if (*end == '-') {
+            spec = end + 1;
+            last = strtol(spec, &end, 10);
+            if (end == spec) return -1;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        spec = end;
+    }
+    return CPU_COUNT(set) > 0 ? CPU_COUNT(set) : -1;
+}
+
+/**
+ * Chooses the CPU for a network thread (main thread only)
+ * @param fd Accepted socket; with --rxaffinity the CPU that processed its
+ *           packets is used if it is in the set, so the handler shares
+ *           caches with the NIC queue's softirq. -1 for round-robin
+ * @return CPU number, -1 when threads are not pinned
+ */
+static int pick_cpu(int fd) {
+    static unsigned next = 0;
+    if (network_cpu_count == 0) return -1;
+
+    if (rx_affinity && fd >= 0) {
+        int cpu;
+        socklen_t len = sizeof(cpu);
+        if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+            cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &network_cpus)) {
+            return cpu;
+        }
+    }
+    int n = next++ % network_cpu_count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &network_cpus) && n-- == 0) return cpu;
+    }
+    return -1;
+}
+
+/**
+ * Starts a detached network thread, pinned to cpu unless it is -1
+ * Threads it creates in turn (a peer link's writer) inherit the pin
+ * @param stack_size Stack to reserve, 0 for the default (8 MB)
+ * @return 0 on success, -1 on failure
+ */
+static int start_thread(void *(*routine)(void *), void *arg, int cpu, size_t stack_size) {
+    pthread_attr_t attr;
+    pthread_t thread_id;
+    int rc;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (stack_size > 0) pthread_attr_setstacksize(&attr, stack_size); // Below the minimum: default
+    if (cpu >= 0) {
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        pthread_attr_setaffinity_np(&attr, sizeof(one), &one);
+    }
+    rc = pthread_create(&thread_id, &attr, routine, arg);
+    pthread_attr_destroy(&attr);
+    return rc == 0 ? 0 : -1;
+}
+
+/**
+ * Queues one relay frame on a peer link
+ * Never blocks, so it is safe under client_list_mutex: a link whose
+ * backlog would exceed PEER_QUEUE_LIMIT is shut down instead, and the
+ * dialing side reconnects
+ */
+static void relay_append(PeerLink *link, const RelayHead *relay, uint8_t flags,
+                         uint32_t stream, const void *payload, uint32_t length) {
+    size_t need = FRAME_HEADER_SIZE + RELAY_HEAD_SIZE + length;
+
+    pthread_mutex_lock(&link->out_mutex);
+    if (link->closing) {
+        pthread_mutex_unlock(&link->out_mutex);
+        return;
+    }
+    if (link->out_len + need > link->out_cap) {
+        size_t cap = link->out_cap > 0 ? link->out_cap : 65536;
+        while (cap < link->out_len + need) cap *= 2;
+        unsigned char *grown = cap <= PEER_QUEUE_LIMIT ? realloc(link->out, cap) : NULL;
+        if (grown == NULL) {
+            fprintf(stderr, "Peer link to node %u is backed up, dropping it\n", link->node);
+            link->closing = 1;
+            shutdown(link->conn->fd, SHUT_RDWR);
+            pthread_cond_signal(&link->out_cond);
+            pthread_mutex_unlock(&link->out_mutex);
+            return;
+        }
+        link->out = grown;
+        link->out_cap = cap;
+    }
+
+    FrameHeader hdr = { RELAY_HEAD_SIZE + length, FRAME_RELAY, flags, 0, stream };
+    unsigned char *p = link->out + link->out_len;
+    encode_frame_header(p, &hdr);
+    encode_relay_head(p + FRAME_HEADER_SIZE, relay);
+    if (length > 0) memcpy(p + FRAME_HEADER_SIZE + RELAY_HEAD_SIZE, payload, length);
+    link->out_len += need;
+    link->frames++;
+    pthread_cond_signal(&link->out_cond);
+    pthread_mutex_unlock(&link->out_mutex);
+}
+
+/**
+ * Queues a relay frame on every live link except the one it came from
+ * @param from Index of the arrival link, -1 for frames created here
+ * Caller must hold client_list_mutex
+ */
+static void relay_forward(int from, const RelayHead *relay, uint8_t flags,
+                          uint32_t stream, const void *payload, uint32_t length) {
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (i != from && peer_links[i].active) {
+            relay_append(&peer_links[i], relay, flags, stream, payload, length);
+        }
+    }
+}
+
+/* Fills in a relay head with a fresh message id of this node */
+static void relay_new(RelayHead *relay, uint8_t kind, const char *user, uint16_t node) {
+    memset(relay, 0, sizeof(*relay));
+    relay->origin = node_id;
+    relay->kind = kind;
+    relay->boot = boot_id;
+    relay->seq = ++relay_seq;
+    if (user != NULL) memcpy(relay->user, user, strnlen(user, USER_ID_SIZE - 1));
+    relay->node = node;
+}
+
+/**
+ * Floods an event created on this node to the whole cluster
+ * Caller must hold client_list_mutex
+ */
+static void relay_local(uint8_t kind, const char *user, uint8_t flags, uint32_t stream,
+                        const void *payload, uint32_t length) {
+    RelayHead relay;
+    if (node_id == 0) return;
+    relay_new(&relay, kind, user, node_id);
+    relay_forward(-1, &relay, flags, stream, payload, length);
+}
+
+/**
+ * Decides whether a flooded frame is new
+ * Frames of one origin do not always arrive in origin order: the JOINs a
+ * node sends to sync a new link take fresh seqs but go out on that link
+ * only, so they can overtake older room messages still travelling the
+ * other way round. Each seq within RELAY_WINDOW of the highest is tracked
+ * on its own; anything older counts as a duplicate. A new boot id means
+ * the origin restarted its counter
+ * Caller must hold client_list_mutex
+ */
+static int relay_accept(const RelayHead *relay) {
+    RelaySeen *seen = &relay_seen[relay->origin];
+    uint64_t seq = relay->seq;
+
+    if (seen->boot != relay->boot) {
+        memset(seen, 0, sizeof(*seen));
+        seen->boot = relay->boot;
+    }
+    if (seq > seen->seq) {
+        // Slots between the old and the new highest seq are reused
+        if (seq - seen->seq >= RELAY_WINDOW) {
+            memset(seen->window, 0, sizeof(seen->window));
+        } else {
+            for (uint64_t s = seen->seq + 1; s <= seq; s++) {
+                seen->window[(s % RELAY_WINDOW) / 64] &= ~(1ull << (s % 64));
+            }
+        }
+        seen->seq = seq;
+    } else if (seen->seq - seq >= RELAY_WINDOW) {
+        return 0;
+    }
+    uint64_t *word = &seen->window[(seq % RELAY_WINDOW) / 64];
+    if (*word & (1ull << (seq % 64))) return 0;
+    *word |= 1ull << (seq % 64);
+    return 1;
+}
+
+/* Maps a zeroed table whose pages are backed only once touched; NULL
+ * when out of address space */
+static void *table_map(size_t bytes) {
+    void *table = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return table == MAP_FAILED ? NULL : table;
+}
+
+/* Index slot where a user's change is, or would go */
+static uint32_t presence_slot(const char *userID, uint16_t node) {
+    uint32_t mask = (uint32_t)presence_capacity * 2 - 1;
+    uint32_t hash = 2166136261u ^ node;    // FNV-1a over node and name
+
+    for (const char *c = userID; *c != '\0'; c++) hash = (hash ^ (unsigned char)*c) * 16777619u;
+    for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        uint32_t entry = presence_index[slot];
+        if (entry == 0) return slot;
+        PresenceChange *change = &presence_changes[entry - 1];
+        if (change->node == node && strcmp(change->userID, userID) == 0) return slot;
+    }
+}
+
+/**
+ * Doubles the change table and rebuilds its index; the table moves with
+ * mremap(), so the entries are not copied
+ * @return 0 on success, -1 when out of memory (the table is unchanged)
+ */
+static int presence_grow(void) {
+    int capacity = presence_capacity > 0 ? presence_capacity * 2 : PRESENCE_TABLE_MIN;
+    size_t bytes = (size_t)capacity * sizeof(PresenceChange);
+    size_t index_bytes = (size_t)capacity * 2 * sizeof(uint32_t);
+    uint32_t *index = table_map(index_bytes);
+    if (index == NULL) return -1;
+
+    void *changes = presence_changes == NULL ? table_map(bytes)
+        : mremap(presence_changes, (size_t)presence_capacity * sizeof(PresenceChange),
+                 bytes, MREMAP_MAYMOVE);
+    if (changes == NULL || changes == MAP_FAILED) {
+        munmap(index, index_bytes);
+        return -1;
+    }
+    if (presence_index != NULL) {
+        munmap(presence_index, (size_t)presence_capacity * 2 * sizeof(uint32_t));
+    }
+    presence_changes = changes;
+    presence_index = index;
+    presence_capacity = capacity;
+    for (int i = 0; i < presence_count; i++) {
+        PresenceChange *change = &presence_changes[i];
+        change->slot = presence_slot(change->userID, change->node);
+        presence_index[change->slot] = (uint32_t)i + 1;
+    }
+    return 0;
+}
+
+/* The current window's change of a user, or NULL */
+static PresenceChange *presence_find(const char *userID, uint16_t node) {
+    if (presence_count == 0) return NULL;
+    uint32_t entry = presence_index[presence_slot(userID, node)];
+    return entry > 0 ? &presence_changes[entry - 1] : NULL;
+}
+
+/**
+ * Records a presence change for the next flush: a join and a leave of
+ * the same user on the same node cancel out, so a reconnect within one
+ * window sends nothing. Caller holds client_list_mutex
+ */
+static void presence_note(uint8_t op, const char *userID, uint16_t node) {
+    char key[USER_ID_SIZE] = "";
+    size_t id_length = strnlen(userID, USER_ID_SIZE - 1);
+    memcpy(key, userID, id_length);
+    key[id_length] = '\0';
+
+    if (presence_count == presence_capacity && presence_grow() < 0) {
+        fprintf(stderr, "Warning: Out of memory, presence change of %s lost.\n", key);
+        return;
+    }
+    uint32_t slot = presence_slot(key, node);
+    if (presence_index[slot] == 0) {
+        PresenceChange *change = &presence_changes[presence_count++];
+        memset(change, 0, sizeof(*change));
+        memcpy(change->userID, key, USER_ID_SIZE);
+        change->node = node;
+        change->slot = slot;
+        presence_index[slot] = (uint32_t)presence_count;
+    }
+    presence_changes[presence_index[slot] - 1].net += op == PRESENCE_JOIN ? 1 : -1;
+}
+
+/**
+ * Encodes the roster as it was when the current window began: everyone
+ * online now, local clients and directory users, with this window's net
+ * changes taken back. The window's diff then brings it up to date, so a
+ * new subscriber gets the same diffs as everyone else
+ * Caller holds client_list_mutex
+ * @param out Room for (max_clients + DIRECTORY_SIZE) entries
+ * @return payload bytes written to out
+ */
+static uint32_t presence_base(unsigned char *out) {
+    PresenceEntry entry = { PRESENCE_JOIN, "", node_id };
+    uint32_t length = 0;
+
+    for (int i = 0; i < presence_count; i++) {
+        PresenceChange *change = &presence_changes[i];
+        change->unseen = change->net > 0 ? change->net : 0;
+    }
+    for (int i = 0; i < client_count + DIRECTORY_SIZE; i++) {
+        if (i < client_count) {
+            memcpy(entry.userID, client_cold[i].userID, USER_ID_SIZE);
+            entry.node = node_id;
+        } else if (directory[i - client_count].userID[0] != '\0') {
+            memcpy(entry.userID, directory[i - client_count].userID, USER_ID_SIZE);
+            entry.node = directory[i - client_count].node;
+        } else {
+            continue;
+        }
+        // Joined this window: not there yet when it began
+        PresenceChange *change = presence_find(entry.userID, entry.node);
+        if (change != NULL && change->unseen > 0) {
+            change->unseen--;
+            continue;
+        }
+        encode_presence_entry(out + length, &entry);
+        length += PRESENCE_ENTRY_SIZE;
+    }
+    for (int i = 0; i < presence_count; i++) {
+        // Left this window: still there when it began
+        PresenceChange *change = &presence_changes[i];
+        PresenceEntry gone = { PRESENCE_JOIN, "", change->node };
+        memcpy(gone.userID, change->userID, USER_ID_SIZE);
+        for (int k = change->net; k < 0; k++) {
+            encode_presence_entry(out + length, &gone);
+            length += PRESENCE_ENTRY_SIZE;
+        }
+    }
+    return length;
+}
+
+/**
+ * Sends a roster encoded by presence_base(), split into frames of at
+ * most FRAME_CHUNK_SIZE bytes (see chat-protocol.h)
+ */
+static void send_snapshot(Conn *conn, const unsigned char *entries, uint32_t length) {
+    uint32_t offset = 0;
+    do {
+        uint32_t part = length - offset > FRAME_CHUNK_SIZE ? FRAME_CHUNK_SIZE : length - offset;
+        uint8_t more = offset + part < length ? FRAME_FLAG_MORE : 0;
+        send_frame(conn, FRAME_PRESENCE, FRAME_FLAG_SNAPSHOT | more, 0, entries + offset, part);
+        offset += part;
+    } while (offset < length);
+}
+
+/* Sends one frame of the window's diff to every subscriber; caller holds
+ * client_list_mutex */
+static void presence_send(const unsigned char *payload, uint32_t length) {
+    for (int i = 0; i < client_count; i++) {
+        if (client_hot[i].caps & FRAME_CAP_PRESENCE) {
+            send_frame(client_hot[i].conn, FRAME_PRESENCE, 0, 0, payload, length);
+        }
+    }
+}
+
+/**
+ * Sends the presence changes of the last window; called by the main loop
+ * every PRESENCE_WINDOW_MS. However many users came and went, every
+ * subscriber gets the same single diff, the window's net changes, in
+ * frames of up to FRAME_CHUNK_SIZE; a mass reconnect of N clients costs
+ * each subscriber N entries rather than N snapshots
+ */
+void presence_flush(void) {
+    static unsigned char payload[FRAME_CHUNK_SIZE];
+    uint32_t length = 0;
+
+    pthread_mutex_lock(&client_list_mutex);
+    if (presence_count == 0) {
+        pthread_mutex_unlock(&client_list_mutex);
+        return;
+    }
+    for (int i = 0; i < presence_count; i++) {
+        PresenceChange *change = &presence_changes[i];
+        PresenceEntry entry = { change->net > 0 ? PRESENCE_JOIN : PRESENCE_LEAVE, "", change->node };
+        memcpy(entry.userID, change->userID, USER_ID_SIZE);
+        for (int k = 0; k < (change->net > 0 ? change->net : -change->net); k++) {
+            if (length == sizeof(payload)) {
+                presence_send(payload, length);
+                length = 0;
+            }
+            encode_presence_entry(payload + length, &entry);
+            length += PRESENCE_ENTRY_SIZE;
+        }
+        presence_index[change->slot] = 0;
+    }
+    if (length > 0) presence_send(payload, length);
+    presence_count = 0;
+    presence_window++;
+    pthread_mutex_unlock(&client_list_mutex);
+}
+
+/* Finds the directory entry of a remote user, or NULL */
+static DirEntry *directory_find(const char *userID) {
+    for (int i = 0; i < DIRECTORY_SIZE; i++) {
+        if (directory[i].userID[0] != '\0' && strcmp(directory[i].userID, userID) == 0) {
+            return &directory[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Records that a user is on a remote node, reachable over link via
+ * The first link an entry is learned on is the fastest path and is kept;
+ * later ones are remembered as fallbacks
+ * Caller must hold client_list_mutex
+ */
+static void directory_add(const char *userID, uint16_t node, int via) {
+    if (node == node_id || userID[0] == '\0') return;
+    DirEntry *entry = directory_find(userID);
+    if (entry != NULL && entry->node == node) {
+        entry->via_mask |= 1u << via;
+        return;
+    }
+    if (entry != NULL) presence_note(PRESENCE_LEAVE, userID, entry->node);
+    for (int i = 0; entry == NULL && i < DIRECTORY_SIZE; i++) {
+        if (directory[i].userID[0] == '\0') entry = &directory[i];
+    }
+    if (entry == NULL) {
+        fprintf(stderr, "Warning: Directory is full, %s not routable.\n", userID);
+        return;
+    }
+    size_t id_length = strnlen(userID, USER_ID_SIZE - 1);
+    memcpy(entry->userID, userID, id_length);
+    entry->userID[id_length] = '\0';
+    entry->node = node;
+    entry->via = via;
+    entry->via_mask = 1u << via;
+    presence_note(PRESENCE_JOIN, userID, node);
+}
+
+/* Forgets a remote user; caller must hold client_list_mutex */
+static void directory_remove(const char *userID, uint16_t node) {
+    DirEntry *entry = directory_find(userID);
+    if (entry != NULL && entry->node == node) {
+        presence_note(PRESENCE_LEAVE, userID, node);
+        memset(entry, 0, sizeof(*entry));
+    }
+}
+
+/**
+ * Drops a link that went down from every entry: users also heard over
+ * another live link are routed through that one, the rest are forgotten
+ * Caller must hold client_list_mutex
+ */
+static void directory_forget_link(int via) {
+    for (int i = 0; i < DIRECTORY_SIZE; i++) {
+        DirEntry *entry = &directory[i];
+        if (entry->userID[0] == '\0' || !(entry->via_mask & (1u << via))) continue;
+        entry->via_mask &= ~(1u << via);
+        for (int link = 0; entry->via == via && link < MAX_PEERS; link++) {
+            if ((entry->via_mask & (1u << link)) && peer_links[link].active) entry->via = link;
+        }
+        if (entry->via == via) {
+            presence_note(PRESENCE_LEAVE, entry->userID, entry->node);
+            memset(entry, 0, sizeof(*entry));
+        }
+    }
+}
+
+/**
+ * Routes a direct message: to local clients of that name, otherwise one
+ * hop toward the node the directory places the target on
+ * @param from Arrival link, -1 if the message was sent on this node
+ * @param relay Relay head naming the target
+ * @param payload DeliverHead followed by the text
+ * @return 0 if delivered or forwarded, -1 if the target is unknown
+ * Caller must hold client_list_mutex
+ */
+static int route_direct(int from, const RelayHead *relay, uint32_t stream,
+                        const void *payload, uint32_t length) {
+    int delivered = 0;
+
+    for (int i = 0; i < client_count; i++) {
+        if (strcmp(client_cold[i].userID, relay->user) == 0) {
+            send_frame(client_hot[i].conn, FRAME_DELIVER, FRAME_FLAG_HEAD | FRAME_FLAG_DIRECT,
+                       stream, payload, length);
+            delivered = 1;
+        }
+    }
+    if (delivered) return 0;
+
+    DirEntry *entry = directory_find(relay->user);
+    if (entry == NULL || entry->via == from || !peer_links[entry->via].active) return -1;
+    relay_append(&peer_links[entry->via], relay, FRAME_FLAG_HEAD | FRAME_FLAG_DIRECT,
+                 stream, payload, length);
+    return 0;
+}
+
+/**
+ * Finds a client by socket in O(1) through client_slot
+ * Caller must hold client_list_mutex
+ * @return index into client_hot and client_cold, -1 if not registered
+ */
+static int client_find(int socket_fd) {
+    if (socket_fd < 0 || socket_fd >= client_slot_count) return -1;
+    return client_slot[socket_fd] - 1;
+}
 
 /**
  * Adds new client to connection list
+ * A presence subscriber first gets its snapshot, sent without holding
+ * client_list_mutex, and joins the tables only if no diff went out in the
+ * meantime (otherwise the snapshot is sent again); until it is in the
+ * tables nobody else writes to it
  * @param new_client ClientInfo structure containing connection details
+ * @return 0 on success, -1 if the client list is full
  * Thread-safe operation using mutex locking
  */
-void add_client(ClientInfo new_client) {
+int add_client(ClientInfo new_client) {
+    size_t roster_bytes = (size_t)(max_clients + DIRECTORY_SIZE) * PRESENCE_ENTRY_SIZE;
+    unsigned char *roster = NULL;
+
+    if ((new_client.caps & FRAME_CAP_PRESENCE) && (roster = table_map(roster_bytes)) == NULL) {
+        perror("Presence snapshot allocation failed");
+        return -1;
+    }
     pthread_mutex_lock(&client_list_mutex);
-    if (client_count < 10) {
-        client_list[client_count++] = new_client;
-    } else {
+    while (roster != NULL && client_count < max_clients) {
+        uint64_t window = presence_window;
+        uint32_t length = presence_base(roster);
+        pthread_mutex_unlock(&client_list_mutex);
+        send_snapshot(new_client.conn, roster, length);
+        pthread_mutex_lock(&client_list_mutex);
+        if (presence_window == window) break;
+    }
+    if (roster != NULL) munmap(roster, roster_bytes);
+    if (client_count >= max_clients || new_client.socket_fd >= client_slot_count) {
+        pthread_mutex_unlock(&client_list_mutex);
         fprintf(stderr, "Warning: Client list is full, cannot add more clients.\n");
+        return -1;
     }
+    client_slot[new_client.socket_fd] = client_count + 1;
+    ClientHot *client = &client_hot[client_count];
+    ClientCold *cold = &client_cold[client_count++];
+    memset(client, 0, sizeof(*client));
+    client->conn = new_client.conn;
+    client->socket_fd = new_client.socket_fd;
+    client->session_id = new_client.session_id;
+    client->caps = new_client.caps;
+    memset(cold, 0, sizeof(*cold));
+    memcpy(cold->ip, new_client.ip, INET_ADDRSTRLEN);
+    memcpy(cold->userID, new_client.userID, USER_ID_SIZE);
+    cold->cpu = new_client.cpu;
+    relay_local(RELAY_JOIN, new_client.userID, 0, 0, NULL, 0);
+    presence_note(PRESENCE_JOIN, new_client.userID, node_id);
     pthread_mutex_unlock(&client_list_mutex);
+    return 0;
 }
 
 /**
- * Broadcasts message to all connected clients except sender
- * @param message Message content to broadcast
- * @param sender_socket Socket descriptor of sending client
- * Formats message with sender info and distributes to all recipients
+ * Sends one frame to every connected client except the sender
+ * Caller must hold client_list_mutex so frames from different senders
+ * never interleave mid-frame on a recipient socket
+ * The payload is compressed at most once, on the first recipient that
+ * negotiated deflate, and the same bytes go to all such recipients
  */
-void broadcast_message(char *message, int sender_socket) {
-    pthread_mutex_lock(&client_list_mutex);
-    char sender_info[FORMAT_SIZE] = {0};
+static void send_to_others(int sender_socket, uint8_t flags, uint32_t stream,
+                           const void *payload, uint32_t length) {
+    static unsigned char packed[FRAME_MAX_PAYLOAD]; // guarded by client_list_mutex
+    long packed_len = -1;   // -1: not attempted yet, 0: not worth it
 
-    // Build sender identification string
     for (int i = 0; i < client_count; i++) {
-        if (client_list[i].socket_fd == sender_socket) {
-            snprintf(sender_info, FORMAT_SIZE,
-                     "%-15s [%-5s] << %-40s",
-                     client_list[i].ip,
-                     client_list[i].userID,
-                     message);
-            break;
+        if (client_hot[i].socket_fd == sender_socket) continue;
+
+        if (client_hot[i].caps & FRAME_CAP_DEFLATE) {
+            if (packed_len < 0) {
+                packed_len = compress_payload(payload, length, packed, sizeof(packed));
+            }
+            if (packed_len > 0) {
+                send_frame(client_hot[i].conn, FRAME_DELIVER,
+                           flags | FRAME_FLAG_DEFLATE, stream, packed, packed_len);
+                continue;
+            }
         }
+        // Failures surface as a read error in the recipient's own thread
+        send_frame(client_hot[i].conn, FRAME_DELIVER, flags, stream,
+                   payload, length);
     }
+}
 
-    // Distribute message to all clients
-    for (int i = 0; i < client_count; i++) {
-        if (client_list[i].socket_fd != sender_socket) {
-            send(client_list[i].socket_fd, sender_info, strlen(sender_info) + 1, 0);
-        }
+/**
+ * Sends a room frame of a local sender to the other local clients and
+ * floods it to the rest of the cluster
+ * Caller must hold client_list_mutex
+ */
+static void fan_out(int sender_socket, uint8_t flags, uint32_t stream,
+                    const void *payload, uint32_t length) {
+    send_to_others(sender_socket, flags, stream, payload, length);
+    relay_local(RELAY_DELIVER, NULL, flags, stream, payload, length);
+}
+
+/**
+ * Returns the current wall clock in milliseconds
+ * CLOCK_REALTIME_COARSE is the kernel's cached tick time: a few ms of
+ * resolution is plenty for chat and it is read without a syscall
+ */
+static uint64_t coarse_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Broadcasts one message chunk to all connected clients except sender
+ * @param head Encoded DeliverHead of the sender (DELIVER_HEAD_SIZE bytes),
+ *             its stamp is filled in here
+ * @param chunk Chunk content to broadcast
+ * @param length Chunk length in bytes (at most FRAME_CHUNK_SIZE)
+ * @param more Non-zero if further chunks of the same message follow
+ * @param sender_socket Socket descriptor of sending client
+ * @param trace Lifecycle trace of the chunk, marked up to TRACE_WRITTEN
+ * The first chunk of a message is prefixed with the sender head; the rest
+ * are forwarded as-is, so a large message is never buffered in full.
+ * The head is built by the caller, so nothing but stamping, copying and
+ * sending happens under the lock. Stamping under the lock makes seq order
+ * equal delivery order on every socket; the sender gets the stamp in a
+ * FRAME_ACK at the same point of its own stream
+ */
+void broadcast_message(const unsigned char *head, const char *chunk, uint32_t length,
+                       int more, int sender_socket, MessageTrace *trace) {
+    static char payload[DELIVER_HEAD_SIZE + FRAME_CHUNK_SIZE]; // guarded by client_list_mutex
+    TRACE_MARK(trace, TRACE_LOCKING, message__locking);
+    pthread_mutex_lock(&client_list_mutex);
+    TRACE_MARK(trace, TRACE_LOCKED, message__locked);
+    int slot = client_find(sender_socket);
+    if (slot < 0) {
+        pthread_mutex_unlock(&client_list_mutex);
+        return;
+    }
+
+    ClientHot *sender = &client_hot[slot];
+    uint8_t flags = more ? FRAME_FLAG_MORE : 0;
+    if (!sender->streaming) {
+        MessageStamp stamp = { ROOM_LOBBY, coarse_now_ms(), ++lobby_seq };
+        memcpy(payload, head, DELIVER_HEAD_SIZE);
+        encode_message_stamp((unsigned char *)payload + DELIVER_STAMP_OFFSET, &stamp);
+        memcpy(payload + DELIVER_HEAD_SIZE, chunk, length);
+        TRACE_MARK(trace, TRACE_ENQUEUED, message__enqueued);
+        send_frame(sender->conn, FRAME_ACK, 0, sender->session_id,
+                   payload + DELIVER_STAMP_OFFSET, MESSAGE_STAMP_SIZE);
+        fan_out(sender_socket, flags | FRAME_FLAG_HEAD, sender->session_id,
+                payload, DELIVER_HEAD_SIZE + length);
+    } else {
+        TRACE_MARK(trace, TRACE_ENQUEUED, message__enqueued);
+        fan_out(sender_socket, flags, sender->session_id, chunk, length);
+    }
+    TRACE_MARK(trace, TRACE_WRITTEN, message__written);
+    sender->streaming = more;
+    pthread_mutex_unlock(&client_list_mutex);
+}
+
+/**
+ * Abandons the sender's half-delivered message, if any
+ * Recipients drop the partial stream instead of displaying it truncated
+ */
+void abort_message(int sender_socket) {
+    pthread_mutex_lock(&client_list_mutex);
+    int i = client_find(sender_socket);
+    if (i >= 0 && client_hot[i].streaming) {
+        fan_out(sender_socket, FRAME_FLAG_ABORT, client_hot[i].session_id, NULL, 0);
+        client_hot[i].streaming = 0;
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+}
+
+/**
+ * Tells a client its message was dropped by the rate limit
+ * @param socket_fd Client socket descriptor
+ * @param retry_ms Milliseconds until the client may send again
+ */
+void send_throttle(int socket_fd, uint32_t retry_ms) {
+    uint32_t retry = htonl(retry_ms);
+
+    pthread_mutex_lock(&client_list_mutex);
+    int i = client_find(socket_fd);
+    if (i >= 0) {
+        client_cold[i].throttled++;
+        send_frame(client_hot[i].conn, FRAME_THROTTLE, 0, 0, &retry, sizeof(retry));
     }
     pthread_mutex_unlock(&client_list_mutex);
 }
 
+/**
+ * Sends an error notice to a single client
+ * Takes client_list_mutex because broadcasters write to the same socket
+ */
+void send_error(int socket_fd, const char *text) {
+    pthread_mutex_lock(&client_list_mutex);
+    int i = client_find(socket_fd);
+    if (i >= 0) send_frame(client_hot[i].conn, FRAME_ERROR, 0, 0, text, strlen(text));
+    pthread_mutex_unlock(&client_list_mutex);
+}
+
 /**
  * Removes client from connection list
  * @param socket_fd Socket descriptor of client to remove
- * Handles client list compaction and server shutdown condition
+ * The last entry moves into the freed one, and a standalone server shuts
+ * down once the list is empty
  */
 void remove_client(int socket_fd) {
     pthread_mutex_lock(&client_list_mutex);
-    for (int i = 0; i < client_count; i++) {
-        if (client_list[i].socket_fd == socket_fd) {
-            printf("User leave: %s (IP: %s)\n", client_list[i].userID, client_list[i].ip);
-            
-            // Compact client list array
-            memmove(&client_list[i], &client_list[i + 1], 
-                   (client_count - i - 1) * sizeof(ClientInfo));
-            client_count--;
-            
-            if (client_count == 0) {
-                printf("All clients disconnected. Server shutdown initiated.\n");
-                close(socket_fd);
-                shutdown_requested = 1;
-            }
+    int i = client_find(socket_fd);
+    if (i >= 0) {
+        printf("User leave: %s (IP: %s)\n", client_cold[i].userID, client_cold[i].ip);
+
+        // Tell recipients to drop a half-delivered message
+        if (client_hot[i].streaming) {
+            fan_out(socket_fd, FRAME_FLAG_ABORT, client_hot[i].session_id, NULL, 0);
+        }
+        relay_local(RELAY_LEAVE, client_cold[i].userID, 0, 0, NULL, 0);
+        presence_note(PRESENCE_LEAVE, client_cold[i].userID, node_id);
+
+        // Keep both tables dense: the last client takes the freed entry
+        int last = --client_count;
+        client_slot[socket_fd] = 0;
+        if (i != last) {
+            client_hot[i] = client_hot[last];
+            client_cold[i] = client_cold[last];
+            client_slot[client_hot[i].socket_fd] = i + 1;
+        }
+
+        // A cluster node keeps relaying for its peers
+        if (client_count == 0 && node_id == 0) {
+            printf("All clients disconnected. Server shutdown initiated.\n");
+            shutdown_requested = 1;
+        }
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+}
+
+/**
+ * Sends a direct message from a local client
+ * @param sender_socket Socket descriptor of the sending client
+ * @param head Encoded DeliverHead of the sender, stamped here
+ * @param target Recipient userID
+ * @return 0 if delivered or forwarded, -1 if no such user is known
+ */
+int send_direct(int sender_socket, const unsigned char *head, const char *target,
+                const char *text, uint32_t length) {
+    static unsigned char payload[DELIVER_HEAD_SIZE + FRAME_CHUNK_SIZE]; // guarded by client_list_mutex
+    MessageStamp stamp = { ROOM_DIRECT, coarse_now_ms(), 0 };
+    RelayHead relay;
+    int rc = -1;
+
+    memcpy(payload, head, DELIVER_HEAD_SIZE);
+    encode_message_stamp(payload + DELIVER_STAMP_OFFSET, &stamp);
+    memcpy(payload + DELIVER_HEAD_SIZE, text, length);
+
+    pthread_mutex_lock(&client_list_mutex);
+    int i = client_find(sender_socket);
+    if (i >= 0) {
+        relay_new(&relay, RELAY_DIRECT, target, 0);
+        rc = route_direct(-1, &relay, client_hot[i].session_id,
+                          payload, DELIVER_HEAD_SIZE + length);
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+    return rc;
+}
+
+/**
+ * Handles one FRAME_RELAY from a peer
+ * Room frames are forwarded first and then delivered locally with a seq
+ * from this node's own room sequence, so local clients still see seq order
+ * equal delivery order; the origin timestamp is kept
+ * @param from Index of the link the frame arrived on
+ */
+static void handle_relay(int from, const FrameHeader *hdr, unsigned char *payload) {
+    RelayHead relay;
+    MessageStamp stamp;
+
+    if (decode_relay_head(payload, hdr->length, &relay) < 0 ||
+        relay.origin == 0 || relay.origin > MAX_NODE_ID || relay.hops >= RELAY_MAX_HOPS) {
+        return;
+    }
+    unsigned char *body = payload + RELAY_HEAD_SIZE;
+    uint32_t length = hdr->length - RELAY_HEAD_SIZE;
+    relay.hops++;
+
+    pthread_mutex_lock(&client_list_mutex);
+    // Direct messages follow a single route, so they are not deduplicated
+    if (relay.kind != RELAY_DIRECT && (relay.origin == node_id || !relay_accept(&relay))) {
+        // A second copy of a JOIN shows another way to the user's node
+        DirEntry *entry = relay.kind == RELAY_JOIN ? directory_find(relay.user) : NULL;
+        if (entry != NULL && entry->node == relay.node) entry->via_mask |= 1u << from;
+        relay_duplicates++;
+        pthread_mutex_unlock(&client_list_mutex);
+        return;
+    }
+    relay_accepted++;
+
+    switch (relay.kind) {
+    case RELAY_DELIVER:
+        relay_forward(from, &relay, hdr->flags, hdr->stream, body, length);
+        if ((hdr->flags & FRAME_FLAG_HEAD) && length >= DELIVER_HEAD_SIZE) {
+            decode_message_stamp(body + DELIVER_STAMP_OFFSET, MESSAGE_STAMP_SIZE, &stamp);
+            stamp.seq = ++lobby_seq;
+            encode_message_stamp(body + DELIVER_STAMP_OFFSET, &stamp);
+        }
+        send_to_others(-1, hdr->flags, hdr->stream, body, length);
+        break;
+    case RELAY_DIRECT:
+        if (length >= DELIVER_HEAD_SIZE) route_direct(from, &relay, hdr->stream, body, length);
+        break;
+    case RELAY_JOIN:
+        directory_add(relay.user, relay.node, from);
+        relay_forward(from, &relay, 0, 0, NULL, 0);
+        break;
+    case RELAY_LEAVE:
+        directory_remove(relay.user, relay.node);
+        relay_forward(from, &relay, 0, 0, NULL, 0);
+        break;
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+}
+
+/**
+ * Peer link writer thread
+ * Swaps the whole queue out and writes it in one go; whatever producers
+ * queue meanwhile goes out with the next write, so relay frames batch up
+ * exactly when the link is busy and cost no extra latency when it is not
+ * @param arg The PeerLink
+ */
+static void *peer_writer(void *arg) {
+    PeerLink *link = arg;
+    unsigned char *batch = NULL;
+    size_t batch_cap = 0;
+
+    pthread_mutex_lock(&link->out_mutex);
+    while (1) {
+        while (link->out_len == 0 && !link->closing) {
+            pthread_cond_wait(&link->out_cond, &link->out_mutex);
+        }
+        if (link->closing) break;
+
+        unsigned char *out = link->out;
+        size_t out_cap = link->out_cap;
+        size_t len = link->out_len;
+        link->out = batch;
+        link->out_cap = batch_cap;
+        link->out_len = 0;
+        batch = out;
+        batch_cap = out_cap;
+        link->batches++;
+        pthread_mutex_unlock(&link->out_mutex);
+
+        int rc = write_full(link->conn, batch, len);
+        pthread_mutex_lock(&link->out_mutex);
+        if (rc < 0) {
+            link->closing = 1;
+            shutdown(link->conn->fd, SHUT_RDWR);   // Lets the reader notice
+            break;
+        }
+    }
+    pthread_mutex_unlock(&link->out_mutex);
+    free(batch);
+    return NULL;
+}
+
+/**
+ * Runs an established peer link until it fails
+ * Registers the link, tells the peer every user this node can route to,
+ * then reads relay frames; on exit forgets what was learned over it
+ * @param conn Connection to the peer, handshake already done
+ * @param remote_node Node id of the peer
+ */
+static void run_peer_link(Conn *conn, uint16_t remote_node) {
+    unsigned char *buffer = malloc(FRAME_MAX_PAYLOAD); // Too big for a handler stack
+    FrameHeader hdr;
+    PeerLink *link = NULL;
+    pthread_t writer;
+    int slot;
+
+    pthread_mutex_lock(&client_list_mutex);
+    for (slot = 0; slot < MAX_PEERS; slot++) {
+        if (!peer_links[slot].active) {
+            link = &peer_links[slot];
             break;
         }
     }
+    if (link == NULL || buffer == NULL) {
+        pthread_mutex_unlock(&client_list_mutex);
+        fprintf(stderr, "Warning: No free peer link for node %u.\n", remote_node);
+        free(buffer);
+        return;
+    }
+    link->active = 1;
+    link->node = remote_node;
+    link->conn = conn;
+    link->closing = 0;
+    link->frames = link->batches = 0;
+
+    // Directory sync: each entry goes out under a fresh id of this node
+    RelayHead relay;
+    for (int i = 0; i < client_count; i++) {
+        relay_new(&relay, RELAY_JOIN, client_cold[i].userID, node_id);
+        relay_append(link, &relay, 0, 0, NULL, 0);
+    }
+    for (int i = 0; i < DIRECTORY_SIZE; i++) {
+        if (directory[i].userID[0] != '\0') {
+            relay_new(&relay, RELAY_JOIN, directory[i].userID, directory[i].node);
+            relay_append(link, &relay, 0, 0, NULL, 0);
+        }
+    }
+    if (pthread_create(&writer, NULL, peer_writer, link) != 0) {
+        perror("Thread creation failed");
+        free(link->out);
+        link->out = NULL;
+        link->out_len = link->out_cap = 0;
+        link->active = 0;
+        pthread_mutex_unlock(&client_list_mutex);
+        free(buffer);
+        return;
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+    printf("Peer link up: node %u\n", remote_node);
+    fflush(stdout);
+
+    while (read_frame_header(conn, &hdr) == 0) {
+        if (hdr.type != FRAME_RELAY) {
+            if (skip_payload(conn, hdr.length) < 0) break;
+            continue;
+        }
+        if (read_full(conn, buffer, hdr.length) < 0) break;
+        handle_relay(slot, &hdr, buffer);
+    }
+
+    // Stop queueing, let the writer go, then free the slot
+    pthread_mutex_lock(&client_list_mutex);
+    directory_forget_link(slot);
+    pthread_mutex_lock(&link->out_mutex);
+    link->closing = 1;
+    pthread_cond_signal(&link->out_cond);
+    pthread_mutex_unlock(&link->out_mutex);
+    pthread_mutex_unlock(&client_list_mutex);
+    pthread_join(writer, NULL);
+
+    pthread_mutex_lock(&client_list_mutex);
+    free(link->out);
+    link->out = NULL;
+    link->out_len = link->out_cap = 0;
+    link->active = 0;
     pthread_mutex_unlock(&client_list_mutex);
+    free(buffer);
+    compress_release();
+    printf("Peer link down: node %u\n", remote_node);
+    fflush(stdout);
 }
 
 /**
- * Client connection handler thread
- * @param arg Pointer to client socket descriptor
- * Manages client registration, message handling, and cleanup
+ * Dials a --peer node and keeps the link up, redialing after failures
+ * @param arg "<host>:<port>" string from the command line
  */
-void *handle_client(void *arg) {
-    int new_socket = *(int *)arg;
-    free(arg);  // Free allocated socket pointer
+static void *peer_dialer(void *arg) {
+    char host[256];
+    const char *spec = arg;
+    const char *colon = strrchr(spec, ':');
+    struct addrinfo hints, *res;
 
-    char buffer[BUFFER_SIZE] = {0};
-    struct sockaddr_in address;
+    if (colon == NULL || colon == spec || (size_t)(colon - spec) >= sizeof(host)) {
+        fprintf(stderr, "Bad peer address: %s\n", spec);
+        return NULL;
+    }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+        fprintf(stderr, "Could not resolve peer: %s\n", spec);
+        return NULL;
+    }
+
+    while (!shutdown_requested) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+            if (fd >= 0) close(fd);
+            usleep(PEER_RETRY_MS * 1000);
+            continue;
+        }
+        // Frames are batched by the link writer already
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        Conn conn;
+        FrameHeader hdr;
+        uint32_t remote;
+        char hello[16];
+        conn_init(&conn, fd);
+        if (busy_poll_us > 0) conn_set_busy_poll(&conn, busy_poll_us);
+        snprintf(hello, sizeof(hello), "PEER:%u", node_id);
+        if (peer_tls_ctx != NULL && tls_connect(&conn, peer_tls_ctx, host, NULL) < 0) {
+            fprintf(stderr, "TLS handshake with peer %s failed\n", spec);
+        } else if (send_frame(&conn, FRAME_HELLO, 0, 0, hello, strlen(hello)) == 0 &&
+            read_frame_header(&conn, &hdr) == 0 && hdr.type == FRAME_WELCOME &&
+            hdr.length == sizeof(remote) && read_full(&conn, &remote, sizeof(remote)) == 0) {
+            run_peer_link(&conn, (uint16_t)ntohl(remote));
+        } else {
+            fprintf(stderr, "Peer %s refused the link\n", spec);
+        }
+        conn_close(&conn);
+        usleep(PEER_RETRY_MS * 1000);
+    }
+    freeaddrinfo(res);
+    return NULL;
+}
+
+/**
+ * Handles a FRAME_DIRECT from a local client: checks limits, then routes
+ * @param client The sender
+ * @param head Encoded DeliverHead of the sender
+ * @param payload Target userID (USER_ID_SIZE - 1 bytes) followed by text
+ * Rejections are reported as FRAME_ERROR; direct messages are not
+ * acknowledged, so a FRAME_THROTTLE would be matched to the wrong message
+ */
+static void handle_direct_frame(const ClientInfo *client, const unsigned char *head,
+                                const char *payload, uint32_t length,
+                                TokenBucket *session_bucket, int ip_slot) {
+    char target[USER_ID_SIZE];
+
+    if (length <= USER_ID_SIZE - 1) return;
+    memcpy(target, payload, USER_ID_SIZE - 1);
+    target[USER_ID_SIZE - 1] = '\0';
+    const char *text = payload + USER_ID_SIZE - 1;
+    length -= USER_ID_SIZE - 1;
+
+    if (length > max_message_size) {
+        send_error(client->socket_fd, "Message too large, dropped.");
+        return;
+    }
+    if (rate_limit_take(session_bucket, ip_slot) > 0) {
+        __atomic_add_fetch(&throttled_messages, 1, __ATOMIC_RELAXED);
+        send_error(client->socket_fd, "Too fast, direct message dropped.");
+        return;
+    }
+    printf("Direct from %s to %s: %.*s%s\n", client->userID, target,
+           length > 40 ? 40 : (int)length, text, length > 40 ? "..." : "");
+    if (send_direct(client->socket_fd, head, target, text, length) < 0) {
+        char notice[48];
+        snprintf(notice, sizeof(notice), "No such user: %s", target);
+        send_error(client->socket_fd, notice);
+    }
+}
+
+/* Maps a session's receive buffers, NULL when out of memory */
+static SessionBuffers *session_buffers_get(void) {
+    SessionBuffers *bufs = mmap(NULL, sizeof(SessionBuffers), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs == MAP_FAILED) return NULL;
+    __atomic_add_fetch(&buffers_held, 1, __ATOMIC_RELAXED);
+    return bufs;
+}
+
+/* Unmaps a session's receive buffers; unlike free(), this hands the pages
+ * back to the kernel instead of keeping them in the thread's malloc arena */
+static void session_buffers_put(SessionBuffers *bufs) {
+    if (bufs == NULL) return;
+    munmap(bufs, sizeof(SessionBuffers));
+    __atomic_sub_fetch(&buffers_held, 1, __ATOMIC_RELAXED);
+}
+
+/* Takes a free session slot, zeroed; NULL when all are in use */
+static Session *session_get(void) {
+    Session *session = NULL;
+
+    pthread_mutex_lock(&session_pool_mutex);
+    if (session_free != NULL) {
+        session = session_free;
+        session_free = session->next_free;
+    } else if (session_pool_used < session_pool_size) {
+        session = &session_pool[session_pool_used++];
+    }
+    pthread_mutex_unlock(&session_pool_mutex);
+    if (session != NULL) memset(session, 0, sizeof(*session));
+    return session;
+}
+
+/* Hands a slot from session_get() back */
+static void session_put(Session *session) {
+    pthread_mutex_lock(&session_pool_mutex);
+    session->next_free = session_free;
+    session_free = session;
+    pthread_mutex_unlock(&session_pool_mutex);
+}
+
+/**
+ * Ends a session: unregisters the client, closes the connection and
+ * frees the slot. The socket is closed only after remove_client(), so its
+ * number cannot be reused while client_slot still maps it
+ */
+static void session_end(Session *session) {
+    if (session->registered) {
+        capture_event(session->capture_id, NULL, NULL);
+        ip_bucket_detach(session->ip_slot);
+        remove_client(session->conn.fd);
+    }
+    conn_close(&session->conn);
+    session_put(session);
+}
+
+/**
+ * Parks a session that has nothing to read in park_fd; its handler
+ * thread must return right after, without touching the session again,
+ * as session_parker() may already be running it on a new thread
+ * @return 0 if parked, -1 if the session has to keep its thread
+ */
+static int session_park(Session *session) {
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = session };
+
+    __atomic_add_fetch(&sessions_parked, 1, __ATOMIC_RELAXED);
+    if (epoll_ctl(park_fd, EPOLL_CTL_ADD, session->conn.fd, &event) < 0) {
+        __atomic_sub_fetch(&sessions_parked, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+void *handle_client(void *arg);
+
+/**
+ * Parker thread: starts a handler thread for each parked session that
+ * has input or hung up. Broadcasts to a parked session are written by
+ * the senders as usual, so it only ever needs a thread to read
+ */
+static void *session_parker(void *arg) {
+    struct epoll_event events[PARK_EVENTS];
+    (void)arg;
+
+    while (1) {
+        int ready = epoll_wait(park_fd, events, PARK_EVENTS, -1);
+        for (int i = 0; i < ready; i++) {
+            Session *session = events[i].data.ptr;
+            epoll_ctl(park_fd, EPOLL_CTL_DEL, session->conn.fd, NULL);
+            __atomic_sub_fetch(&sessions_parked, 1, __ATOMIC_RELAXED);
+            if (start_thread(handle_client, session, session->cpu, SESSION_STACK_SIZE) < 0) {
+                perror("Thread creation failed");
+                session_end(session);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Registers a new connection: TLS handshake if required, HELLO, WELCOME,
+ * then the client tables. A "PEER:" HELLO runs the peer link instead
+ * @return 0 once the session is a registered client, -1 when the
+ *         connection is done with (refused, failed, or a link that went down)
+ */
+static int session_register(Session *session) {
+    ClientInfo *new_client = &session->info;
+    Conn *conn = &session->conn;
+    int new_socket = conn->fd;
+    SessionBuffers *bufs = NULL;
+    FrameHeader hdr;
+    struct sockaddr_storage address;
     socklen_t addrlen = sizeof(address);
 
-    // Get client connection information
-    getpeername(new_socket, (struct sockaddr *)&address, &addrlen);
-    char *client_ip = inet_ntoa(address.sin_addr);
+    if (busy_poll_us > 0) conn_set_busy_poll(conn, busy_poll_us);
 
     // Initialize client structure
-    ClientInfo new_client;
-    strncpy(new_client.ip, client_ip, INET_ADDRSTRLEN);
-    new_client.socket_fd = new_socket;
+    new_client->socket_fd = new_socket;
+    new_client->conn = conn;
+    new_client->cpu = network_cpu_count > 0 ? sched_getcpu() : -1;
+
+    // Get client connection information; AF_UNIX peers are on this host
+    getpeername(new_socket, (struct sockaddr *)&address, &addrlen);
+    int is_local = address.ss_family == AF_UNIX;
+    if (is_local) {
+        strcpy(new_client->ip, "unix");
+        new_client->addr = htonl(INADDR_LOOPBACK);
+    } else {
+        struct sockaddr_in *inet = (struct sockaddr_in *)&address;
+        inet_ntop(AF_INET, &inet->sin_addr, new_client->ip, INET_ADDRSTRLEN);
+        new_client->addr = inet->sin_addr.s_addr;
+    }
 
-    // Process client registration
-    int valread = read(new_socket, buffer, BUFFER_SIZE);
-    if (valread > 0 && strncmp(buffer, "USER:", 5) == 0) {
-        strncpy(new_client.userID, buffer + 5, 5);
-        new_client.userID[5] = '\0';
-        printf("User registered: %s (IP: %s)\n", new_client.userID, new_client.ip);
+    // With a certificate loaded, TCP connections must open with a TLS
+    // handshake; a plaintext HELLO is answered with an error
+    if (tls_ctx != NULL && !is_local) {
+        int is_tls = tls_sniff(new_socket);
+        if (is_tls == 0) {
+            fprintf(stderr, "Plaintext connection refused (IP: %s)\n", new_client->ip);
+            send_frame(conn, FRAME_ERROR, 0, 0, "TLS required.", 13);
+        } else if (is_tls < 0 || tls_accept(conn, tls_ctx, REGISTER_TIMEOUT_MS) < 0) {
+            fprintf(stderr, "TLS handshake failed (IP: %s)\n", new_client->ip);
+        }
+        if (conn->ssl == NULL) return -1;
     }
-    add_client(new_client);
 
-    // Message handling loop
+    // Process client registration; a client that never says HELLO does
+    // not get to keep the thread and the slot
+    if (read_frame_header_timeout(conn, &hdr, REGISTER_TIMEOUT_MS) != 0 || hdr.type != FRAME_HELLO ||
+        (bufs = session_buffers_get()) == NULL ||
+        read_full(conn, bufs->buffer, hdr.length) < 0) {
+        fprintf(stderr, "Registration failed (IP: %s)\n", new_client->ip);
+        session_buffers_put(bufs);
+        return -1;
+    }
+    bufs->buffer[hdr.length] = '\0';
+    if (strncmp(bufs->buffer, "PEER:", 5) == 0) {
+        // Another node of the cluster; answer with our node id
+        long remote = strtol(bufs->buffer + 5, NULL, 10);
+        session_buffers_put(bufs);
+        if (node_id == 0 || remote <= 0 || remote > MAX_NODE_ID || remote == node_id) {
+            fprintf(stderr, "Peer link refused (IP: %s, node %ld)\n", new_client->ip, remote);
+            send_frame(conn, FRAME_ERROR, 0, 0, "Peer refused.", 13);
+        } else {
+            uint32_t self = htonl(node_id);
+            int one = 1;
+            setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (send_frame(conn, FRAME_WELCOME, 0, 0, &self, sizeof(self)) == 0) {
+                run_peer_link(conn, (uint16_t)remote);
+            }
+        }
+        return -1;
+    }
+    if (strncmp(bufs->buffer, "USER:", 5) == 0) {
+        strncpy(new_client->userID, bufs->buffer + 5, 5);
+        new_client->userID[5] = '\0';
+        printf("User registered: %s (IP: %s)\n", new_client->userID, new_client->ip);
+        if (conn->ssl != NULL) {
+            char description[96];
+            tls_describe(conn, description, sizeof(description));
+            printf("  over %s\n", description);
+        }
+    }
+    uint32_t capture_id = capture_fp != NULL ? capture_begin(&hdr, bufs->buffer) : 0;
+    session_buffers_put(bufs);
+    new_client->caps = hdr.flags & server_caps;
+    if (!is_local) new_client->caps &= ~FRAME_CAP_SHM;
+
+    // Advertise the message size limit and accepted capabilities before
+    // any broadcast can reach us; an accepted shm request is followed by
+    // the ring pair and all further frames use it
+    uint32_t limit = htonl(max_message_size);
+    send_frame(conn, FRAME_WELCOME, new_client->caps, 0, &limit, sizeof(limit));
+    if ((new_client->caps & FRAME_CAP_SHM) && shm_offer(conn, shm_ring_size) < 0) {
+        perror("Shared memory setup failed");
+        capture_event(capture_id, NULL, NULL);
+        return -1;
+    }
+    // Broadcasts write to us under client_list_mutex, so no write may
+    // wait long for our peer; a TLS backlog is left to this thread
+    if (conn_set_nowait(conn) < 0) {
+        perror("Session setup failed");
+        capture_event(capture_id, NULL, NULL);
+        return -1;
+    }
+    pthread_mutex_lock(&client_list_mutex);
+    new_client->session_id = ((uint32_t)node_id << 24) | (next_session_id++ & 0xFFFFFF);
+    pthread_mutex_unlock(&client_list_mutex);
+    if (add_client(*new_client) < 0) {
+        send_frame(conn, FRAME_ERROR, 0, 0, "Server full.", 12);
+        capture_event(capture_id, NULL, NULL);
+        return -1;
+    }
+
+    // Sender fields of the delivery head never change for this session
+    DeliverHead head;
+    memset(&head, 0, sizeof(head));
+    head.addr = new_client->addr;
+    memcpy(head.userID, new_client->userID, USER_ID_SIZE);
+    encode_deliver_head(session->head_bytes, &head);
+
+    // Rate limit state: the session's handler threads own the session bucket
+    session->bucket.tokens = session_limit.burst;
+    session->bucket.refilled_ns = monotonic_ns();
+    session->ip_slot = ip_bucket_attach(new_client->addr);
+    session->capture_id = capture_id;
+    session->registered = 1;
+    return 0;
+}
+
+/**
+ * Client connection handler thread
+ * @param arg The Session, from the accept loop or session_parker()
+ * Registers the client on its first run, then handles messages
+ * Runs on a SESSION_STACK_SIZE stack; per-frame buffers are mapped on
+ * demand and dropped, with the thread's zlib state, whenever the session
+ * has been quiet for SESSION_IDLE_MS. A plain session never calls malloc
+ * or free, which would give the thread its own malloc arena. Then, when
+ * nothing is waiting, a plaintext socket session parks and the thread
+ * exits; the next one starts when the client sends again
+ */
+void *handle_client(void *arg) {
+    Session *session = arg;
+    ClientInfo *client = &session->info;
+    Conn *conn = &session->conn;
+    SessionBuffers *bufs = NULL;
+    FrameHeader hdr;
+    MessageTrace trace = { 0 };
+
+    __atomic_add_fetch(&handler_threads, 1, __ATOMIC_RELAXED);
+    if (!session->registered && session_register(session) < 0) {
+        session_end(session);
+        __atomic_sub_fetch(&handler_threads, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    // Only a plain socket can be watched by epoll: TLS may hold decrypted
+    // input or a backlog only this thread sends, shm input arrives in the
+    // ring, and busy polling is there to avoid the wakeup
+    int parkable = conn->ssl == NULL && conn->rx == NULL && conn->busy_poll_us == 0;
+
+    // Message handling loop: one frame (at most one chunk) per iteration
     while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        valread = read(new_socket, buffer, BUFFER_SIZE);
-        
-        if (valread <= 0 || strcmp(buffer, "bye") == 0) break;
-        
-        printf("Message from %s: %s\n", new_client.userID, buffer);
-        broadcast_message(buffer, new_socket);
+        // A quiet session gives its buffers and zlib state back; only the
+        // few stack pages of this thread stay behind until it parks
+        int rc = read_frame_header_timeout(conn, &hdr,
+                                           bufs != NULL ? SESSION_IDLE_MS : parkable ? 0 : -1);
+        if (rc == 1 && bufs != NULL) {
+            session_buffers_put(bufs);
+            bufs = NULL;
+            compress_release();
+            continue;
+        }
+        if (rc == 1) {
+            if (session_park(session) == 0) {
+                __atomic_sub_fetch(&handler_threads, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            parkable = 0;
+            continue;
+        }
+        if (rc < 0 || hdr.type == FRAME_BYE) break;
+        trace_begin(&trace, client->session_id, hdr.length);
+        if (bufs == NULL && (bufs = session_buffers_get()) == NULL) break;
+        if (hdr.type == FRAME_DIRECT && hdr.length <= FRAME_CHUNK_SIZE) {
+            if (read_full(conn, bufs->buffer, hdr.length) < 0) break;
+            capture_event(session->capture_id, &hdr, bufs->buffer);
+            handle_direct_frame(client, session->head_bytes, bufs->buffer, hdr.length,
+                                &session->bucket, session->ip_slot);
+            continue;
+        }
+        if (hdr.type != FRAME_TEXT || hdr.length > FRAME_CHUNK_SIZE) {
+            if (skip_payload(conn, hdr.length) < 0) break;
+            continue;
+        }
+        if (read_full(conn, bufs->buffer, hdr.length) < 0) break;
+        capture_event(session->capture_id, &hdr, bufs->buffer);
+
+        char *text = bufs->buffer;
+        if (hdr.flags & FRAME_FLAG_DEFLATE) {
+            long n = -1;
+            if (client->caps & FRAME_CAP_DEFLATE) {
+                n = decompress_payload(bufs->buffer, hdr.length, bufs->inflated,
+                                       sizeof(bufs->inflated));
+            }
+            if (n < 0) {
+                fprintf(stderr, "Bad compressed frame from %s\n", client->userID);
+                break;
+            }
+            text = bufs->inflated;
+            hdr.length = (uint32_t)n;
+        }
+        TRACE_MARK(&trace, TRACE_DECODED, message__decoded);
+
+        int more = (hdr.flags & FRAME_FLAG_MORE) != 0;
+        if (!session->discarding && hdr.length > max_message_size - session->message_bytes) {
+            fprintf(stderr, "Message from %s exceeds %u bytes, dropped\n",
+                    client->userID, max_message_size);
+            send_error(conn->fd, "Message too large, dropped.");
+            abort_message(conn->fd);
+            session->discarding = 1;
+        }
+        if (session->discarding) {
+            if (!more) {
+                session->discarding = 0;
+                session->message_bytes = 0;
+            }
+            continue;
+        }
+
+        // Every frame fans out to all clients, so each costs a token. A new
+        // message without one is dropped; the rest of a message already
+        // half-delivered waits for tokens instead, which backs the sender
+        // up through TCP flow control
+        uint32_t wait = rate_limit_take(&session->bucket, session->ip_slot);
+        if (wait > 0 && session->message_bytes == 0) {
+            __atomic_add_fetch(&throttled_messages, 1, __ATOMIC_RELAXED);
+            send_throttle(conn->fd, wait);
+            session->discarding = more;
+            continue;
+        }
+        if (wait > 0) {
+            __atomic_add_fetch(&throttled_waits, 1, __ATOMIC_RELAXED);
+            do {
+                usleep(wait * 1000);
+            } while ((wait = rate_limit_take(&session->bucket, session->ip_slot)) > 0);
+        }
+
+        if (session->message_bytes == 0) {
+            __atomic_add_fetch(&messages_relayed, 1, __ATOMIC_RELAXED);
+            printf("Message from %s: %.*s%s\n", client->userID,
+                   hdr.length > 40 ? 40 : (int)hdr.length, text,
+                   (hdr.length > 40 || more) ? "..." : "");
+        }
+        session->message_bytes = more ? session->message_bytes + hdr.length : 0;
+        broadcast_message(session->head_bytes, text, hdr.length, more, conn->fd, &trace);
+        trace_end(&trace);
     }
 
     // Connection cleanup
-    remove_client(new_socket);
-    close(new_socket);
+    session_buffers_put(bufs);
+    compress_release();
+    session_end(session);
+    __atomic_sub_fetch(&handler_threads, 1, __ATOMIC_RELAXED);
     return NULL;
 }
 
 /**
  * Main server function
  * Sets up TCP server socket and manages client connections
- * Implements non-blocking accept with 100ms sleep interval
+ * Polls the listening socket with a 100ms timeout
  */
-int main(void) {
+int main(int argc, char *argv[]) {
     int server_fd, new_socket;
-    struct sockaddr_in server_address, client_address;
+    struct sockaddr_in server_address;
     int opt = 1;
-    int addrlen = sizeof(server_address);
+    const char *unix_path = NULL;   // AF_UNIX listener path, NULL = TCP only
+    int unix_fd = -1;
+    const char *peer_specs[MAX_PEERS]; // --peer addresses to dial
+    int peer_count = 0;
+    const char *tls_cert = NULL, *tls_key = NULL, *tls_ca = NULL;
+    const char *capture_path = NULL; // --capture file
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--maxclients", 12) == 0) {
+            long clients = strtol(argv[i] + 12, NULL, 10);
+            if (clients <= 0 || clients > 10000000) {
+                fprintf(stderr, "--maxclients must be between 1 and 10000000\n");
+                return EXIT_FAILURE;
+            }
+            max_clients = (int)clients;
+        } else if (strncmp(argv[i], "--max", 5) == 0) {
+            long limit = strtol(argv[i] + 5, NULL, 10);
+            if (limit <= 0 || limit > MAX_MESSAGE_LIMIT) {
+                fprintf(stderr, "--max must be between 1 and %d bytes\n", MAX_MESSAGE_LIMIT);
+                return EXIT_FAILURE;
+            }
+            max_message_size = (uint32_t)limit;
+        } else if (strcmp(argv[i], "--nocompress") == 0) {
+            server_caps &= ~FRAME_CAP_DEFLATE;
+        } else if (strncmp(argv[i], "--rate", 6) == 0) {
+            session_limit.rate = strtod(argv[i] + 6, NULL);
+        } else if (strncmp(argv[i], "--burst", 7) == 0) {
+            session_limit.burst = strtod(argv[i] + 7, NULL);
+        } else if (strncmp(argv[i], "--iprate", 8) == 0) {
+            ip_limit.rate = strtod(argv[i] + 8, NULL);
+        } else if (strncmp(argv[i], "--ipburst", 9) == 0) {
+            ip_limit.burst = strtod(argv[i] + 9, NULL);
+        } else if (strncmp(argv[i], "--unix", 6) == 0) {
+            unix_path = argv[i][6] != '\0' ? argv[i] + 6 : DEFAULT_UNIX_PATH;
+        } else if (strncmp(argv[i], "--port", 6) == 0) {
+            long port = strtol(argv[i] + 6, NULL, 10);
+            if (port <= 0 || port > 65535) {
+                fprintf(stderr, "--port must be between 1 and 65535\n");
+                return EXIT_FAILURE;
+            }
+            listen_port = (uint16_t)port;
+        } else if (strncmp(argv[i], "--node", 6) == 0) {
+            long node = strtol(argv[i] + 6, NULL, 10);
+            if (node <= 0 || node > MAX_NODE_ID) {
+                fprintf(stderr, "--node must be between 1 and %d\n", MAX_NODE_ID);
+                return EXIT_FAILURE;
+            }
+            node_id = (uint16_t)node;
+        } else if (strncmp(argv[i], "--peer", 6) == 0) {
+            if (peer_count == MAX_PEERS) {
+                fprintf(stderr, "At most %d --peer options\n", MAX_PEERS);
+                return EXIT_FAILURE;
+            }
+            peer_specs[peer_count++] = argv[i] + 6;
+        } else if (strncmp(argv[i], "--tlscert", 9) == 0) {
+            tls_cert = argv[i] + 9;
+        } else if (strncmp(argv[i], "--tlskey", 8) == 0) {
+            tls_key = argv[i] + 8;
+        } else if (strncmp(argv[i], "--tlsca", 7) == 0) {
+            tls_ca = argv[i] + 7;
+        } else if (strncmp(argv[i], "--cpus", 6) == 0) {
+            network_cpu_count = parse_cpu_list(argv[i] + 6, &network_cpus);
+            if (network_cpu_count < 0) {
+                fprintf(stderr, "--cpus takes a CPU list such as 0-3,6\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--rxaffinity") == 0) {
+            rx_affinity = 1;
+        } else if (strncmp(argv[i], "--busypoll", 10) == 0) {
+            long usecs = strtol(argv[i] + 10, NULL, 10);
+            if (usecs <= 0 || usecs > 1000000) {
+                fprintf(stderr, "--busypoll must be between 1 and 1000000 us\n");
+                return EXIT_FAILURE;
+            }
+            busy_poll_us = (int)usecs;
+        } else if (strncmp(argv[i], "--capture", 9) == 0) {
+            capture_path = argv[i] + 9;
+
+        } else if (strncmp(argv[i], "--trace", 7) == 0) {
+            long every = argv[i][7] != '\0' ? strtol(argv[i] + 7, NULL, 10) : 1;
+            if (every <= 0) {
+                fprintf(stderr, "--trace sample interval must be at least 1\n");
+                return EXIT_FAILURE;
+            }
+            trace_every = (unsigned)every;
+        } else if (strncmp(argv[i], "--shmring", 9) == 0) {
+            shm_ring_size = strtoul(argv[i] + 9, NULL, 10);
+            if (shm_ring_size < 4096 || (shm_ring_size & (shm_ring_size - 1)) != 0) {
+                fprintf(stderr, "--shmring must be a power of two of at least 4096\n");
+                return EXIT_FAILURE;
+            }
+        } else {
+            printf("Usage: %s [--max<bytes>] [--nocompress] [--rate<msg/s>] [--burst<n>]"
+                   " [--iprate<msg/s>] [--ipburst<n>] [--unix[<path>]] [--shmring<bytes>]"
+                   " [--port<n>] [--node<1-%d> [--peer<host>:<port>]...]"
+                   " [--tlscert<file> --tlskey<file> [--tlsca<file>]] [--trace[<n>]]"
+                   " [--cpus<list> [--rxaffinity]] [--busypoll<us>] [--capture<file>]"
+                   " [--maxclients<n>]\n",
+                   argv[0], MAX_NODE_ID);
+            return EXIT_FAILURE;
+        }
+    }
+    if (session_limit.burst < 1 || ip_limit.burst < 1) {
+        fprintf(stderr, "--burst and --ipburst must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+    if (peer_count > 0 && node_id == 0) {
+        fprintf(stderr, "--peer requires --node\n");
+        return EXIT_FAILURE;
+    }
+    if (rx_affinity && network_cpu_count == 0) {
+        fprintf(stderr, "--rxaffinity requires --cpus\n");
+        return EXIT_FAILURE;
+    }
+    if (network_cpu_count > 0) {
+        // A thread pinned outside the CPUs this process may use (offline,
+        // or excluded by taskset/cgroups) fails to start, and with it
+        // every connection it was meant for: refuse such a list up front
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+            perror("sched_getaffinity failed");
+            return EXIT_FAILURE;
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &network_cpus) && !CPU_ISSET(cpu, &allowed)) {
+                fprintf(stderr, "--cpus: CPU %d is offline or not allowed for this process"
+                        " (%d usable)\n", cpu, CPU_COUNT(&allowed));
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    if ((tls_cert == NULL) != (tls_key == NULL)) {
+        fprintf(stderr, "--tlscert and --tlskey go together\n");
+        return EXIT_FAILURE;
+    }
+    if (tls_cert != NULL) {
+        // Peers verify each other against --tlsca (or the system store)
+        if ((tls_ctx = tls_server_ctx(tls_cert, tls_key)) == NULL ||
+            (peer_count > 0 && (peer_tls_ctx = tls_client_ctx(tls_ca)) == NULL)) {
+            fprintf(stderr, "TLS setup failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Every session holds a descriptor (TLS two): take all the kernel
+    // allows, and no more clients than fit
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+        getrlimit(RLIMIT_NOFILE, &files);
+    }
+    client_slot_count = files.rlim_cur < (rlim_t)INT_MAX ? (int)files.rlim_cur : INT_MAX;
+    if (max_clients > client_slot_count - FD_RESERVE) {
+        max_clients = client_slot_count > 2 * FD_RESERVE ? client_slot_count - FD_RESERVE
+                                                         : FD_RESERVE;
+        printf("Open file limit %d: at most %d clients\n", client_slot_count, max_clients);
+    }
+
+    // Session and client tables for max_clients; their pages are backed
+    // only as far as the sessions reach
+    session_pool_size = max_clients + MAX_PEERS;
+    session_pool = table_map((size_t)session_pool_size * sizeof(Session));
+    client_hot = table_map((size_t)max_clients * sizeof(ClientHot));
+    client_cold = table_map((size_t)max_clients * sizeof(ClientCold));
+    client_slot = table_map((size_t)client_slot_count * sizeof(int));
+    if (session_pool == NULL || client_hot == NULL || client_cold == NULL ||
+        client_slot == NULL) {
+        perror("Client table allocation failed");
+        return EXIT_FAILURE;
+    }
+    if ((park_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        start_thread(session_parker, NULL, pick_cpu(-1), 0) < 0) {
+        perror("Parker setup failed");
+        return EXIT_FAILURE;
+    }
+
+    if (network_cpu_count > 0) {
+        printf("Network threads pinned to %d CPU(s)%s\n", network_cpu_count,
+               rx_affinity ? ", following each connection's RX CPU" : "");
+    }
+    if (busy_poll_us > 0) printf("Busy polling for %d us before blocking\n", busy_poll_us);
+    if (capture_path != NULL) {
+        if ((capture_fp = capture_create(capture_path)) == NULL) {
+            perror("Capture file creation failed");
+            return EXIT_FAILURE;
+        }
+        capture_start_ns = trace_clock();
+        printf("Capturing client traffic to %s\n", capture_path);
+    }
+
+    // Counters are dumped on demand; the handler only sets a flag
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stats;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    // OpenSSL writes through plain write(): a client that vanishes must
+    // fail that write, not kill the server
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
 
     // Create server socket
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
@@ -185,7 +2126,7 @@ int main(void) {
     // Configure server address
     server_address.sin_family = AF_INET;
     server_address.sin_addr.s_addr = INADDR_ANY;
-    server_address.sin_port = htons(PORT);
+    server_address.sin_port = htons(listen_port);
 
     // Bind and listen
     if (bind(server_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
@@ -193,37 +2134,102 @@ int main(void) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_fd, 10) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("Listen failed");
         exit(EXIT_FAILURE);
     }
-    printf("Server (PID: %d) listening on port %d...\n", getpid(), PORT);
+    printf("Server (PID: %d) listening on port %d%s (max message %u bytes, %d clients)...\n",
+           getpid(), listen_port, tls_ctx != NULL ? " with TLS" : "", max_message_size,
+           max_clients);
 
-    // Main server loop
+    // Optional AF_UNIX listener for clients on this host
+    if (unix_path != NULL) {
+        struct sockaddr_un unix_address;
+        memset(&unix_address, 0, sizeof(unix_address));
+        unix_address.sun_family = AF_UNIX;
+        strncpy(unix_address.sun_path, unix_path, sizeof(unix_address.sun_path) - 1);
+        unlink(unix_path);  // Stale socket from a previous run
+        if ((unix_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            bind(unix_fd, (struct sockaddr *)&unix_address, sizeof(unix_address)) < 0 ||
+            listen(unix_fd, SOMAXCONN) < 0) {
+            perror("Unix socket setup failed");
+            exit(EXIT_FAILURE);
+        }
+        printf("Also listening on %s\n", unix_path);
+    }
+
+    // Cluster mode: a random boot id keeps message ids unique across
+    // restarts; every --peer is dialed (and redialed) by its own thread
+    if (node_id != 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        boot_id = (uint32_t)(now.tv_sec ^ now.tv_nsec ^ ((uint32_t)getpid() << 16));
+        for (int i = 0; i < MAX_PEERS; i++) {
+            pthread_mutex_init(&peer_links[i].out_mutex, NULL);
+            pthread_cond_init(&peer_links[i].out_cond, NULL);
+        }
+        printf("Cluster node %u, %d peer(s) to dial\n", node_id, peer_count);
+        for (int i = 0; i < peer_count; i++) {
+            if (start_thread(peer_dialer, (void *)peer_specs[i], pick_cpu(-1), 0) < 0) {
+                perror("Thread creation failed");
+            }
+        }
+    }
+
+    // Main server loop: wake at least every 100ms to notice shutdown and
+    // stats requests, accept as soon as a connection is pending
+    struct pollfd listen_pfd[2] = {
+        { .fd = server_fd, .events = POLLIN },
+        { .fd = unix_fd, .events = POLLIN }     // ignored by poll() when -1
+    };
+    uint64_t presence_flushed_ns = monotonic_ns();
+    baseline_rss_kib = resident_kib();
     while (!shutdown_requested) {
-        new_socket = accept(server_fd, (struct sockaddr *)&client_address, 
-                           (socklen_t *)&addrlen);
+        if (stats_requested) {
+            stats_requested = 0;
+            dump_stats();
+        }
+        uint64_t now = monotonic_ns();
+        if (now - presence_flushed_ns >= PRESENCE_WINDOW_MS * 1000000ull) {
+            presence_flush();
+            presence_flushed_ns = now;
+        }
+        if (poll(listen_pfd, 2, 100) <= 0) continue;
+
+        int ready_fd = (listen_pfd[0].revents & POLLIN) ? server_fd : unix_fd;
+        new_socket = accept(ready_fd, NULL, NULL);
         
-        if (new_socket >= 0) {
-            int *client_sock = malloc(sizeof(int));
-            *client_sock = new_socket;
-            
-            pthread_t thread_id;
-            if (pthread_create(&thread_id, NULL, handle_client, client_sock) != 0) {
-                perror("Thread creation failed");
-                free(client_sock);
-                close(new_socket);
-            } else {
-                pthread_detach(thread_id);
+        // A new connection is parked right away: its first handler thread
+        // starts when the client's first bytes arrive
+        Session *session = new_socket >= 0 ? session_get() : NULL;
+        if (session != NULL) {
+            conn_init(&session->conn, new_socket);
+            session->cpu = pick_cpu(new_socket);
+            if (session_park(session) < 0) {
+                perror("Session setup failed");
+                session_end(session);
             }
-        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        } else if (new_socket >= 0) {
+            fprintf(stderr, "Warning: All %d sessions in use, connection refused.\n",
+                    session_pool_size);
+            close(new_socket);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
             perror("Accept error");
         }
-        
-        usleep(100000);  // Non-blocking sleep
     }
 
     // Cleanup resources
+    dump_stats();
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_fp != NULL) {
+        fclose(capture_fp);
+        capture_fp = NULL;
+    }
+    pthread_mutex_unlock(&capture_mutex);
+    if (unix_fd >= 0) {
+        close(unix_fd);
+        unlink(unix_path);
+    }
     pthread_mutex_destroy(&client_list_mutex);
     close(server_fd);
     return 0;
@@ -0,0 +1,48 @@
+/*
+ * File: chat-capture.h
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Capture file of inbound client traffic, written by
+ *              chat-server --capture and read by chat-replay
+ * Layout: CAPTURE_MAGIC, then one record per event in arrival order. A
+ *         record is CAPTURE_RECORD_SIZE bytes (time in us since the
+ *         capture started, connection number, kind, 3 pad) followed, for
+ *         OPEN and FRAME, by the frame exactly as the client sent it
+ *         (header and payload, compressed payloads left compressed).
+ *         All integers are in network order.
+ */
+
+#ifndef CHAT_CAPTURE_H
+#define CHAT_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "chat-protocol.h"
+
+#define CAPTURE_MAGIC "CHATCAP1"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_RECORD_SIZE 16
+
+/* Record kinds */
+enum {
+    CAPTURE_OPEN = 1,   // connection registered, carries its HELLO frame
+    CAPTURE_FRAME,      // inbound TEXT or DIRECT frame
+    CAPTURE_CLOSE       // connection ended (BYE or hangup)
+};
+
+/* Decoded record; hdr is only meaningful for OPEN and FRAME */
+typedef struct {
+    uint64_t time_us;               // Since the start of the capture
+    uint32_t conn;                  // Connection number, from 1
+    uint8_t kind;                   // CAPTURE_*
+    FrameHeader hdr;
+} CaptureRecord;
+
+FILE *capture_create(const char *path);
+int capture_write(FILE *fp, const CaptureRecord *record, const void *payload);
+FILE *capture_open(const char *path);
+int capture_read(FILE *fp, CaptureRecord *record, void *payload, size_t size);
+
+#endif /* CHAT_CAPTURE_H */
@@ -0,0 +1,30 @@
+/*
+ * File: chat-compress.h
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Optional per-frame payload compression
+ * Negotiation: the client sets FRAME_CAP_DEFLATE in the flags of its HELLO
+ *              frame; the server echoes the accepted capabilities in the
+ *              flags of its WELCOME frame. Afterwards either side may send
+ *              frames whose payload is raw deflate (FRAME_FLAG_DEFLATE),
+ *              primed with a shared dictionary of common chat text.
+ *              Each frame is compressed independently so the server can
+ *              compress a broadcast once and send the same bytes to every
+ *              recipient.
+ */
+
+#ifndef CHAT_COMPRESS_H
+#define CHAT_COMPRESS_H
+
+#include <stddef.h>
+
+#define FRAME_CAP_DEFLATE 0x01  // HELLO/WELCOME flag: deflate understood
+#define FRAME_FLAG_DEFLATE 0x08 // payload is raw deflate
+#define COMPRESS_MIN_SIZE 48    // smaller payloads never shrink
+
+size_t compress_payload(const void *in, size_t length, void *out, size_t capacity);
+long decompress_payload(const void *in, size_t length, void *out, size_t capacity);
+void compress_release(void);
+
+#endif /* CHAT_COMPRESS_H */
@@ -0,0 +1,165 @@
+/*
+ * File: chat-protocol.h
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Wire protocol shared by chat-client and chat-server
+ * Framing: every message on the socket is a fixed 12-byte header followed by
+ *          up to FRAME_MAX_PAYLOAD payload bytes. Messages larger than one
+ *          chunk are streamed as a run of frames carrying FRAME_FLAG_MORE,
+ *          terminated by a frame without it. The server forwards each chunk
+ *          as it arrives; only the first delivered frame of a message
+ *          (FRAME_FLAG_HEAD) carries the binary DeliverHead. All layout is
+ *          left to the client.
+ * Cluster: servers link up as peers with a HELLO of "PEER:<node>" and
+ *          exchange FRAME_RELAY frames. Each carries a RelayHead whose
+ *          message id (origin, boot, seq) lets every node accept a frame
+ *          once however many paths it arrives on.
+ * Presence: clients that set FRAME_CAP_PRESENCE get a FRAME_PRESENCE
+ *           snapshot right after WELCOME, then one diff per
+ *           PRESENCE_WINDOW_MS window: its net changes, split into frames
+ *           of up to FRAME_CHUNK_SIZE. The snapshot is the roster as the
+ *           current window began, so the client's own join arrives with
+ *           the first diff like everyone else's. Each payload is a run of
+ *           PRESENCE_ENTRY_SIZE entries; the roster is a multiset, so a
+ *           user with two sessions is listed twice. A snapshot larger than
+ *           FRAME_CHUNK_SIZE is split: every part carries
+ *           FRAME_FLAG_SNAPSHOT, all but the last FRAME_FLAG_MORE, and a
+ *           part after one with FRAME_FLAG_MORE adds to the roster.
+ */
+
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chat-transport.h"
+
+#define PORT 8080
+#define USER_ID_SIZE 6                      // max 5 chars + null
+#define FRAME_HEADER_SIZE 12
+#define FRAME_CHUNK_SIZE 16384              // max text bytes per frame
+#define FRAME_HEAD_ROOM 256                 // extra room for a delivery head
+#define FRAME_MAX_PAYLOAD (FRAME_CHUNK_SIZE + FRAME_HEAD_ROOM)
+#define DEFAULT_MAX_MESSAGE 65536           // default per-message limit
+#define MAX_MESSAGE_LIMIT (16 * 1024 * 1024) // hard ceiling for --max
+#define PRESENCE_WINDOW_MS 100              // presence diffs are batched this long
+
+/* Frame types */
+enum {
+    FRAME_HELLO = 1,    // client -> server: "USER:<id>" registration
+    FRAME_WELCOME,      // server -> client: uint32 max message size
+    FRAME_TEXT,         // client -> server: message chunk
+    FRAME_DELIVER,      // server -> client: forwarded message chunk
+    FRAME_ERROR,        // server -> client: NUL-free error text
+    FRAME_BYE,          // client -> server: orderly disconnect
+    FRAME_ACK,          // server -> client: MessageStamp of own message
+    FRAME_THROTTLE,     // server -> client: own message dropped by the rate
+                        //   limit, uint32 ms until a token is available
+    FRAME_DIRECT,       // client -> server: direct message, target userID
+                        //   (USER_ID_SIZE - 1 bytes, NUL-padded) then text
+    FRAME_RELAY,        // server -> server: RelayHead then the relayed body
+    FRAME_PRESENCE      // server -> client: presence entries, a snapshot if
+                        //   FRAME_FLAG_SNAPSHOT is set, else a diff
+};
+
+/* Frame flags */
+#define FRAME_FLAG_MORE  0x01   // more chunks of this message follow
+#define FRAME_FLAG_ABORT 0x02   // sender went away mid-message, drop stream
+#define FRAME_FLAG_HEAD  0x04   // payload starts with the sender head
+#define FRAME_FLAG_DIRECT 0x10  // direct message, outside the room sequence
+#define FRAME_FLAG_SNAPSHOT 0x20 // presence payload replaces the whole roster
+
+#define FRAME_CAP_PRESENCE 0x04 // HELLO/WELCOME flag: presence frames wanted
+
+#define ROOM_LOBBY 0            // the single room every client joins
+#define ROOM_DIRECT 0xFFFF      // stamp room of direct messages (seq 0)
+
+/* Server-assigned position of a message (MESSAGE_STAMP_SIZE bytes on the
+ * wire: room, timestamp, seq). seq increases by one per message in a room,
+ * so a client can order messages and spot gaps; the sender learns the
+ * stamp of its own message from a FRAME_ACK carrying the same bytes */
+#define MESSAGE_STAMP_SIZE 18
+typedef struct {
+    uint16_t room;                  // Room the message was posted to
+    uint64_t timestamp_ms;          // Server receive time, ms since epoch
+    uint64_t seq;                   // Per-room sequence number, from 1
+} MessageStamp;
+
+/* Sender metadata leading a FRAME_FLAG_HEAD delivery (DELIVER_HEAD_SIZE
+ * bytes on the wire: addr, userID without NUL, 1 pad, stamp) */
+#define DELIVER_HEAD_SIZE 28
+#define DELIVER_STAMP_OFFSET 10
+typedef struct {
+    uint32_t addr;                  // Sender IPv4 address, network order
+    char userID[USER_ID_SIZE];      // Sender username, NUL-terminated
+    MessageStamp stamp;
+} DeliverHead;
+
+/* Relay kinds */
+enum {
+    RELAY_DELIVER = 1,  // room message frame, flooded to every node
+    RELAY_DIRECT,       // direct message, routed hop by hop to its target
+    RELAY_JOIN,         // user joined node `node`, flooded
+    RELAY_LEAVE         // user left node `node`, flooded
+};
+
+#define MAX_NODE_ID 255         // node ids fill the top byte of stream ids
+#define RELAY_MAX_HOPS 16       // frames travelling further are dropped
+
+/* Prefix of every FRAME_RELAY payload (RELAY_HEAD_SIZE bytes on the wire:
+ * origin, kind, hops, boot, seq, user without NUL, 1 pad, node). Frame
+ * flags and stream are those of the delivery being relayed */
+#define RELAY_HEAD_SIZE 24
+typedef struct {
+    uint16_t origin;                // Node that created the message
+    uint8_t kind;                   // RELAY_*
+    uint8_t hops;                   // Links traversed so far
+    uint32_t boot;                  // Origin incarnation, changes on restart
+    uint64_t seq;                   // Per-origin message counter
+    char user[USER_ID_SIZE];        // Target (DIRECT) or subject (JOIN/LEAVE)
+    uint16_t node;                  // Home node of user (JOIN/LEAVE)
+} RelayHead;
+
+/* Presence operations */
+enum {
+    PRESENCE_JOIN = 1,  // one more session of user on node
+    PRESENCE_LEAVE      // one session fewer
+};
+
+/* One presence change (PRESENCE_ENTRY_SIZE bytes on the wire: op, userID
+ * without NUL, node) */
+#define PRESENCE_ENTRY_SIZE 8
+typedef struct {
+    uint8_t op;                     // PRESENCE_*
+    char userID[USER_ID_SIZE];
+    uint16_t node;                  // Node the user is connected to, 0 standalone
+} PresenceEntry;
+
+/* Decoded frame header (host byte order) */
+typedef struct {
+    uint32_t length;    // payload bytes following the header
+    uint8_t type;       // one of FRAME_*
+    uint8_t flags;      // FRAME_FLAG_* bits
+    uint16_t reserved;
+    uint32_t stream;    // message stream (sender session id on deliveries)
+} FrameHeader;
+
+void encode_frame_header(unsigned char *out, const FrameHeader *hdr);
+void decode_frame_header(const unsigned char *in, FrameHeader *hdr);
+int read_frame_header(Conn *conn, FrameHeader *hdr);
+int read_frame_header_timeout(Conn *conn, FrameHeader *hdr, int timeout_ms);
+int send_frame(Conn *conn, uint8_t type, uint8_t flags, uint32_t stream,
+               const void *payload, uint32_t length);
+int skip_payload(Conn *conn, uint32_t length);
+void encode_message_stamp(unsigned char *out, const MessageStamp *stamp);
+int decode_message_stamp(const unsigned char *in, uint32_t length, MessageStamp *stamp);
+void encode_deliver_head(unsigned char *out, const DeliverHead *head);
+int decode_deliver_head(const unsigned char *in, uint32_t length, DeliverHead *head);
+void encode_relay_head(unsigned char *out, const RelayHead *head);
+int decode_relay_head(const unsigned char *in, uint32_t length, RelayHead *head);
+void encode_presence_entry(unsigned char *out, const PresenceEntry *entry);
+int decode_presence_entry(const unsigned char *in, uint32_t length, PresenceEntry *entry);
+
+#endif /* CHAT_PROTOCOL_H */
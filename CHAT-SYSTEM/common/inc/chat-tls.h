@@ -0,0 +1,47 @@
+/*
+ * File: chat-tls.h
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Optional TLS under the frame protocol (OpenSSL)
+ * Handshake: TLS starts right after the TCP connect, before HELLO. The
+ *            server tells a ClientHello from a plaintext frame by its first
+ *            byte (0x16; frame lengths start with 0x00), so one port serves
+ *            both and can refuse plaintext clients.
+ * Resumption: the server issues TLS 1.3 session tickets; the client keeps
+ *             the last one in a file so the next run resumes without
+ *             certificate work.
+ * Offload: kTLS is requested on every session. When the kernel takes over
+ *          transmit encryption, the backlog goes straight to send().
+ * Writes: never block while holding the session lock; see chat-tls.c for
+ *         the backlog and the nowait mode of server sessions.
+ */
+
+#ifndef CHAT_TLS_H
+#define CHAT_TLS_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "chat-transport.h"
+
+#define TLS_HANDSHAKE_RECORD 0x16   // First byte of a ClientHello
+#define TLS_WRITE_CHUNK 65536       // Backlog bytes handed to one SSL_write
+#define TLS_BACKLOG_LIMIT (4 * 1024 * 1024) // Unsent bytes before a nowait session is dropped
+
+struct ssl_ctx_st;
+
+struct ssl_ctx_st *tls_server_ctx(const char *cert_file, const char *key_file);
+struct ssl_ctx_st *tls_client_ctx(const char *ca_file);
+int tls_sniff(int fd);
+int tls_accept(Conn *conn, struct ssl_ctx_st *ctx, int timeout_ms);
+int tls_connect(Conn *conn, struct ssl_ctx_st *ctx, const char *host, const char *session_file);
+int tls_set_nowait(Conn *conn);
+ssize_t tls_read(Conn *conn, void *buf, size_t len);
+ssize_t tls_read_nowait(Conn *conn, void *buf, size_t len);
+int tls_writev(Conn *conn, const struct iovec *iov, int iovcnt);
+int tls_poll(Conn *conn, int timeout_ms);
+void tls_describe(Conn *conn, char *out, size_t size);
+void tls_close(Conn *conn);
+
+#endif /* CHAT_TLS_H */
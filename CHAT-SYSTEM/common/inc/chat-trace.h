@@ -0,0 +1,80 @@
+/*
+ * File: chat-trace.h
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Per-message lifecycle tracing for chat-server
+ * Probes: every stage fires a USDT probe in provider "chat" when the build
+ *         has <sys/sdt.h> (e.g. bpftrace -e
+ *         'usdt:./chat-server:chat:message__locked { ... }'); a probe is a
+ *         single nop until a tracer attaches. Without the header the probes
+ *         compile to nothing.
+ * Sampler: independently, one message in trace_every is timestamped at
+ *          each stage and the gaps are folded into per-stage log2
+ *          histograms, printed by trace_dump(). With trace_every at 0 a
+ *          stage costs one predictable branch.
+ */
+
+#ifndef CHAT_TRACE_H
+#define CHAT_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CHAT_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef CHAT_HAVE_SDT
+#define CHAT_PROBE1(name, a) DTRACE_PROBE1(chat, name, a)
+#define CHAT_PROBE2(name, a, b) DTRACE_PROBE2(chat, name, a, b)
+#else
+#define CHAT_PROBE1(name, a) ((void)(a))
+#define CHAT_PROBE2(name, a, b) ((void)(a), (void)(b))
+#endif
+
+/* Points in the life of a relayed frame, in order */
+enum {
+    TRACE_RECEIVED,     // frame header read
+    TRACE_DECODED,      // payload read and inflated
+    TRACE_LOCKING,      // about to take client_list_mutex
+    TRACE_LOCKED,       // client_list_mutex held
+    TRACE_ENQUEUED,     // stamped and encoded, first write starts
+    TRACE_WRITTEN,      // last recipient write returned
+    TRACE_POINTS
+};
+
+#define TRACE_BUCKETS 40            // log2 ns buckets, up to ~550 s
+
+/* Timestamps of one frame; at[] is only filled when sampled */
+typedef struct {
+    uint32_t stream;
+    int sampled;
+    uint64_t at[TRACE_POINTS];
+} MessageTrace;
+
+extern unsigned trace_every;        // Sample 1 frame in N, 0 = off
+
+/* Monotonic nanoseconds (vDSO, no syscall) */
+static inline uint64_t trace_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* Fires the stage's probe and, for sampled frames, records the time */
+#define TRACE_MARK(trace, point, probe)                                 \
+    do {                                                                \
+        CHAT_PROBE1(probe, (trace)->stream);                            \
+        if ((trace)->sampled) (trace)->at[point] = trace_clock();       \
+    } while (0)
+
+void trace_begin(MessageTrace *trace, uint32_t stream, uint32_t length);
+void trace_end(MessageTrace *trace);
+void trace_dump(FILE *out);
+
+#endif /* CHAT_TRACE_H */
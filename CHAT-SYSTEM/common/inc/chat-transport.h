@@ -0,0 +1,90 @@
+/*
+ * File: chat-transport.h
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Byte transports under the frame protocol
+ * Transports: a connected socket (TCP or AF_UNIX), or, for clients on the
+ *             same host, a pair of shared-memory SPSC rings negotiated over
+ *             an AF_UNIX connection (FRAME_CAP_SHM). Frames are laid out
+ *             in a ring exactly as on a socket. Sleeping readers and
+ *             writers park on futex words inside the shared mapping; the
+ *             socket stays open only so either side notices a hangup.
+ *             TCP connections may instead run TLS (see chat-tls.h).
+ * Busy poll: opt-in per connection. A reader spins for up to busy_poll_us
+ *            (non-blocking reads, or ring polls) before it blocks, and the
+ *            socket gets SO_BUSY_POLL so the kernel polls the NIC queue
+ *            too. Trades a CPU per waiting reader for wakeup latency.
+ * Nowait: server sessions are written to by other threads holding a lock
+ *         every session needs, so their writes must not wait on a slow
+ *         peer. A socket or ring write waits at most CONN_STALL_MS for
+ *         the peer to make room in the send buffer or ring; a peer that
+ *         has not by then is disconnected, and its own thread cleans up.
+ */
+
+#ifndef CHAT_TRANSPORT_H
+#define CHAT_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define FRAME_CAP_SHM 0x02              // HELLO/WELCOME flag: shm rings
+#define DEFAULT_UNIX_PATH "/tmp/chat-server.sock"
+#define SHM_RING_SIZE (1024 * 1024)     // data bytes per direction
+#define SHM_SPIN_LIMIT 2000             // polls before parking on the futex
+#define LIVENESS_CHECK_MS 100           // hangup check while parked
+#define CONN_STALL_MS 200               // longest wait of a nowait write
+
+/* One direction of the shared mapping; producer and consumer cursors sit
+ * on separate cache lines so they do not bounce between cores */
+typedef struct {
+    uint64_t head __attribute__((aligned(64)));  // bytes ever written
+    uint32_t data_seq;          // bumped after each publish (futex word)
+    uint32_t data_waiting;      // consumer is parked on data_seq
+    uint64_t tail __attribute__((aligned(64)));  // bytes ever consumed
+    uint32_t space_seq;         // bumped after each consume (futex word)
+    uint32_t space_waiting;     // producer is parked on space_seq
+    uint32_t closed __attribute__((aligned(64))); // either end hung up
+    uint32_t capacity;          // data bytes, power of two
+    unsigned char data[] __attribute__((aligned(64)));
+} ShmRing;
+
+struct ssl_st;
+
+/* A connection as seen by the frame layer */
+typedef struct {
+    int fd;                     // Socket; only a hangup detector once shm is up
+    ShmRing *rx;                // Ring consumed by this side, NULL on sockets
+    ShmRing *tx;                // Ring produced by this side
+    void *shm_base;             // Whole mapping, for munmap
+    size_t shm_size;
+    struct ssl_st *ssl;         // TLS session, NULL for plaintext
+    pthread_mutex_t ssl_mutex;  // Serialises every call on ssl and the fields below
+    int ktls_tx;                // Kernel encrypts: write the socket directly
+    unsigned char *tls_out;     // TLS backlog: plaintext not yet taken by the socket
+    size_t tls_out_off;         // First unsent byte
+    size_t tls_out_len;
+    size_t tls_out_cap;
+    size_t tls_retry;           // Length of an SSL_write to repeat, 0 = none
+    int nowait;                 // Writers must not wait on the peer (server sessions)
+    int tls_wake;               // eventfd that wakes the reader in nowait mode, or -1
+    int busy_poll_us;           // Spin this long before blocking, 0 = block at once
+} Conn;
+
+void conn_init(Conn *conn, int fd);
+void conn_close(Conn *conn);
+int conn_set_busy_poll(Conn *conn, int usecs);
+int conn_set_nowait(Conn *conn);
+int read_full(Conn *conn, void *buf, size_t len);
+int read_full_timeout(Conn *conn, void *buf, size_t len, int timeout_ms);
+ssize_t conn_read_nowait(Conn *conn, void *buf, size_t len);
+int write_full(Conn *conn, const void *buf, size_t len);
+int conn_writev(Conn *conn, const struct iovec *iov, int iovcnt);
+int conn_poll(Conn *conn, int timeout_ms);
+
+int shm_offer(Conn *conn, size_t ring_size);
+int shm_accept(Conn *conn);
+
+#endif /* CHAT_TRANSPORT_H */
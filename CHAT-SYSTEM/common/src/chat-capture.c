@@ -0,0 +1,103 @@
+/*
+ * File: chat-capture.c
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Capture file encoding (see chat-capture.h)
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include "chat-capture.h"
+
+/**
+ * Creates a capture file and writes its magic
+ * @return stream with a large buffer, or NULL on error
+ */
+FILE *capture_create(const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) return NULL;
+    setvbuf(fp, NULL, _IOFBF, 1 << 16);
+    if (fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_SIZE, fp) != CAPTURE_MAGIC_SIZE) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+/**
+ * Appends one record; the caller serialises writers
+ * @param payload record->hdr.length bytes for OPEN and FRAME
+ * @return 0 on success, -1 on write error
+ */
+int capture_write(FILE *fp, const CaptureRecord *record, const void *payload) {
+    unsigned char raw[CAPTURE_RECORD_SIZE + FRAME_HEADER_SIZE];
+    uint64_t time_us = htobe64(record->time_us);
+    uint32_t conn = htonl(record->conn);
+    size_t size = CAPTURE_RECORD_SIZE;
+
+    memcpy(raw, &time_us, 8);
+    memcpy(raw + 8, &conn, 4);
+    raw[12] = record->kind;
+    memset(raw + 13, 0, 3);
+    if (record->kind != CAPTURE_CLOSE) {
+        encode_frame_header(raw + CAPTURE_RECORD_SIZE, &record->hdr);
+        size += FRAME_HEADER_SIZE;
+    }
+    if (fwrite(raw, 1, size, fp) != size) return -1;
+    if (record->kind != CAPTURE_CLOSE && record->hdr.length > 0 &&
+        fwrite(payload, 1, record->hdr.length, fp) != record->hdr.length) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Opens a capture file for reading
+ * @return stream positioned at the first record, NULL if missing or not
+ *         a capture
+ */
+FILE *capture_open(const char *path) {
+    char magic[CAPTURE_MAGIC_SIZE];
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return NULL;
+    if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+        memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+/**
+ * Reads the next record and its payload
+ * @param size Capacity of payload; FRAME_MAX_PAYLOAD always suffices
+ * @return 1 on success, 0 at end of file, -1 on a truncated or corrupt record
+ */
+int capture_read(FILE *fp, CaptureRecord *record, void *payload, size_t size) {
+    unsigned char raw[CAPTURE_RECORD_SIZE + FRAME_HEADER_SIZE];
+    uint64_t time_us;
+    uint32_t conn;
+
+    size_t n = fread(raw, 1, CAPTURE_RECORD_SIZE, fp);
+    if (n == 0 && feof(fp)) return 0;
+    if (n != CAPTURE_RECORD_SIZE) return -1;
+    memcpy(&time_us, raw, 8);
+    memcpy(&conn, raw + 8, 4);
+    record->time_us = be64toh(time_us);
+    record->conn = ntohl(conn);
+    record->kind = raw[12];
+    memset(&record->hdr, 0, sizeof(record->hdr));
+
+    if (record->kind == CAPTURE_CLOSE) return 1;
+    if (record->kind != CAPTURE_OPEN && record->kind != CAPTURE_FRAME) return -1;
+    if (fread(raw + CAPTURE_RECORD_SIZE, 1, FRAME_HEADER_SIZE, fp) != FRAME_HEADER_SIZE) return -1;
+    decode_frame_header(raw + CAPTURE_RECORD_SIZE, &record->hdr);
+    if (record->hdr.length > size ||
+        fread(payload, 1, record->hdr.length, fp) != record->hdr.length) {
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,99 @@
+/*
+ * File: chat-compress.c
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Raw deflate with a preset chat dictionary (zlib)
+ *              Streams are kept per thread and reset between frames, so the
+ *              ~256 KB deflate state is allocated once, not per message;
+ *              compress_release() gives it back when a thread goes idle.
+ */
+
+#include <string.h>
+#include <zlib.h>
+
+#include "chat-compress.h"
+
+/* Preset dictionary: most frequent material last, as zlib recommends */
+static const char chat_dictionary[] =
+    "https://www. .com .org thanks thank you please sorry okay sure "
+    "what when where which would could should there their they them "
+    "about because going really think know just have that this with "
+    "from your will been were here yeah lol :) haha morning tonight "
+    "tomorrow meeting today later again right now good great hello hi "
+    "the and you for are not but all can did get has him his how its ";
+
+static __thread z_stream deflater;
+static __thread int deflater_ready = 0;
+static __thread z_stream inflater;
+static __thread int inflater_ready = 0;
+
+/**
+ * Compresses one payload
+ * @return compressed size, or 0 if compression failed or did not shrink
+ *         the payload (the caller then sends it raw)
+ */
+size_t compress_payload(const void *in, size_t length, void *out, size_t capacity) {
+    if (length < COMPRESS_MIN_SIZE) return 0;
+
+    if (!deflater_ready) {
+        memset(&deflater, 0, sizeof(deflater));
+        if (deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            return 0;
+        }
+        deflater_ready = 1;
+    } else {
+        deflateReset(&deflater);
+    }
+    deflateSetDictionary(&deflater, (const Bytef *)chat_dictionary,
+                         sizeof(chat_dictionary) - 1);
+
+    // Anything not smaller than the input is useless
+    if (capacity > length - 1) capacity = length - 1;
+    deflater.next_in = (Bytef *)in;
+    deflater.avail_in = (uInt)length;
+    deflater.next_out = out;
+    deflater.avail_out = (uInt)capacity;
+    if (deflate(&deflater, Z_FINISH) != Z_STREAM_END) return 0;
+    return capacity - deflater.avail_out;
+}
+
+/**
+ * Decompresses one payload into at most capacity bytes
+ * @return decompressed size, or -1 on corrupt or oversized input
+ */
+long decompress_payload(const void *in, size_t length, void *out, size_t capacity) {
+    if (!inflater_ready) {
+        memset(&inflater, 0, sizeof(inflater));
+        if (inflateInit2(&inflater, -15) != Z_OK) return -1;
+        inflater_ready = 1;
+    } else {
+        inflateReset(&inflater);
+    }
+    inflateSetDictionary(&inflater, (const Bytef *)chat_dictionary,
+                         sizeof(chat_dictionary) - 1);
+
+    inflater.next_in = (Bytef *)in;
+    inflater.avail_in = (uInt)length;
+    inflater.next_out = out;
+    inflater.avail_out = (uInt)capacity;
+    if (inflate(&inflater, Z_FINISH) != Z_STREAM_END) return -1;
+    return (long)(capacity - inflater.avail_out);
+}
+
+/**
+ * Frees this thread's streams; the next call sets them up again
+ * Long-lived threads call it when idle and before they exit, so a quiet
+ * connection does not pin ~300 KB of zlib state
+ */
+void compress_release(void) {
+    if (deflater_ready) {
+        deflateEnd(&deflater);
+        deflater_ready = 0;
+    }
+    if (inflater_ready) {
+        inflateEnd(&inflater);
+        inflater_ready = 0;
+    }
+}
@@ -0,0 +1,218 @@
+/*
+ * File: chat-protocol.c
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Frame encoding and blocking frame I/O helpers shared by
+ *              chat-client and chat-server
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include "chat-protocol.h"
+
+/* Serialises a header into FRAME_HEADER_SIZE bytes of network order */
+void encode_frame_header(unsigned char *out, const FrameHeader *hdr) {
+    uint32_t length = htonl(hdr->length);
+    uint16_t reserved = htons(hdr->reserved);
+    uint32_t stream = htonl(hdr->stream);
+
+    memcpy(out, &length, 4);
+    out[4] = hdr->type;
+    out[5] = hdr->flags;
+    memcpy(out + 6, &reserved, 2);
+    memcpy(out + 8, &stream, 4);
+}
+
+/* Parses FRAME_HEADER_SIZE bytes of network order into a header */
+void decode_frame_header(const unsigned char *in, FrameHeader *hdr) {
+    uint32_t length, stream;
+    uint16_t reserved;
+
+    memcpy(&length, in, 4);
+    memcpy(&reserved, in + 6, 2);
+    memcpy(&stream, in + 8, 4);
+    hdr->length = ntohl(length);
+    hdr->type = in[4];
+    hdr->flags = in[5];
+    hdr->reserved = ntohs(reserved);
+    hdr->stream = ntohl(stream);
+}
+
+/**
+ * Reads and decodes the next frame header
+ * @return 0 on success, -1 on error, end of stream or oversized frame
+ */
+int read_frame_header(Conn *conn, FrameHeader *hdr) {
+    return read_frame_header_timeout(conn, hdr, -1);
+}
+
+/**
+ * Like read_frame_header(), but gives up if no frame starts in timeout_ms
+ * @param timeout_ms Idle limit, -1 waits indefinitely
+ * @return 0 on success, 1 on timeout, -1 on error, end of stream or
+ *         oversized frame
+ */
+int read_frame_header_timeout(Conn *conn, FrameHeader *hdr, int timeout_ms) {
+    unsigned char raw[FRAME_HEADER_SIZE];
+
+    int rc = read_full_timeout(conn, raw, sizeof(raw), timeout_ms);
+    if (rc != 0) return rc;
+    decode_frame_header(raw, hdr);
+    if (hdr->length > FRAME_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sends one frame; header and payload go out in a single write
+ * @return 0 on success, -1 on error
+ */
+int send_frame(Conn *conn, uint8_t type, uint8_t flags, uint32_t stream,
+               const void *payload, uint32_t length) {
+    unsigned char raw[FRAME_HEADER_SIZE];
+    FrameHeader hdr = { length, type, flags, 0, stream };
+    struct iovec iov[2];
+
+    encode_frame_header(raw, &hdr);
+    iov[0].iov_base = raw;
+    iov[0].iov_len = sizeof(raw);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = length;
+    return conn_writev(conn, iov, length > 0 ? 2 : 1);
+}
+
+/* Reads and discards a payload the caller does not want */
+int skip_payload(Conn *conn, uint32_t length) {
+    unsigned char scratch[512];
+    while (length > 0) {
+        uint32_t n = length < sizeof(scratch) ? length : sizeof(scratch);
+        if (read_full(conn, scratch, n) < 0) return -1;
+        length -= n;
+    }
+    return 0;
+}
+
+/* Serialises a message stamp into MESSAGE_STAMP_SIZE bytes */
+void encode_message_stamp(unsigned char *out, const MessageStamp *stamp) {
+    uint16_t room = htons(stamp->room);
+    uint64_t timestamp = htobe64(stamp->timestamp_ms);
+    uint64_t seq = htobe64(stamp->seq);
+
+    memcpy(out, &room, 2);
+    memcpy(out + 2, &timestamp, 8);
+    memcpy(out + 10, &seq, 8);
+}
+
+/**
+ * Parses a message stamp
+ * @return 0 on success, -1 if fewer than MESSAGE_STAMP_SIZE bytes remain
+ */
+int decode_message_stamp(const unsigned char *in, uint32_t length, MessageStamp *stamp) {
+    uint16_t room;
+    uint64_t timestamp, seq;
+
+    if (length < MESSAGE_STAMP_SIZE) return -1;
+    memcpy(&room, in, 2);
+    memcpy(&timestamp, in + 2, 8);
+    memcpy(&seq, in + 10, 8);
+    stamp->room = ntohs(room);
+    stamp->timestamp_ms = be64toh(timestamp);
+    stamp->seq = be64toh(seq);
+    return 0;
+}
+
+/* Serialises a delivery head into DELIVER_HEAD_SIZE bytes */
+void encode_deliver_head(unsigned char *out, const DeliverHead *head) {
+    memcpy(out, &head->addr, 4);
+    memset(out + 4, 0, 6);
+    memcpy(out + 4, head->userID, strnlen(head->userID, USER_ID_SIZE - 1));
+    encode_message_stamp(out + DELIVER_STAMP_OFFSET, &head->stamp);
+}
+
+/**
+ * Parses the delivery head at the start of a FRAME_FLAG_HEAD payload
+ * @return 0 on success, -1 if the payload is too short
+ */
+int decode_deliver_head(const unsigned char *in, uint32_t length, DeliverHead *head) {
+    if (length < DELIVER_HEAD_SIZE) return -1;
+    memcpy(&head->addr, in, 4);
+    memcpy(head->userID, in + 4, USER_ID_SIZE - 1);
+    head->userID[USER_ID_SIZE - 1] = '\0';
+    return decode_message_stamp(in + DELIVER_STAMP_OFFSET,
+                                length - DELIVER_STAMP_OFFSET, &head->stamp);
+}
+
+/* Serialises a relay head into RELAY_HEAD_SIZE bytes */
+void encode_relay_head(unsigned char *out, const RelayHead *head) {
+    uint16_t origin = htons(head->origin);
+    uint32_t boot = htonl(head->boot);
+    uint64_t seq = htobe64(head->seq);
+    uint16_t node = htons(head->node);
+
+    memcpy(out, &origin, 2);
+    out[2] = head->kind;
+    out[3] = head->hops;
+    memcpy(out + 4, &boot, 4);
+    memcpy(out + 8, &seq, 8);
+    memset(out + 16, 0, 6);
+    memcpy(out + 16, head->user, strnlen(head->user, USER_ID_SIZE - 1));
+    memcpy(out + 22, &node, 2);
+}
+
+/**
+ * Parses the relay head at the start of a FRAME_RELAY payload
+ * @return 0 on success, -1 if the payload is too short
+ */
+int decode_relay_head(const unsigned char *in, uint32_t length, RelayHead *head) {
+    uint16_t origin, node;
+    uint32_t boot;
+    uint64_t seq;
+
+    if (length < RELAY_HEAD_SIZE) return -1;
+    memcpy(&origin, in, 2);
+    memcpy(&boot, in + 4, 4);
+    memcpy(&seq, in + 8, 8);
+    memcpy(&node, in + 22, 2);
+    head->origin = ntohs(origin);
+    head->kind = in[2];
+    head->hops = in[3];
+    head->boot = ntohl(boot);
+    head->seq = be64toh(seq);
+    memcpy(head->user, in + 16, USER_ID_SIZE - 1);
+    head->user[USER_ID_SIZE - 1] = '\0';
+    head->node = ntohs(node);
+    return 0;
+}
+
+/* Serialises a presence entry into PRESENCE_ENTRY_SIZE bytes */
+void encode_presence_entry(unsigned char *out, const PresenceEntry *entry) {
+    uint16_t node = htons(entry->node);
+
+    out[0] = entry->op;
+    memset(out + 1, 0, 5);
+    memcpy(out + 1, entry->userID, strnlen(entry->userID, USER_ID_SIZE - 1));
+    memcpy(out + 6, &node, 2);
+}
+
+/**
+ * Parses one presence entry
+ * @return 0 on success, -1 if fewer than PRESENCE_ENTRY_SIZE bytes remain
+ */
+int decode_presence_entry(const unsigned char *in, uint32_t length, PresenceEntry *entry) {
+    uint16_t node;
+
+    if (length < PRESENCE_ENTRY_SIZE) return -1;
+    entry->op = in[0];
+    memcpy(entry->userID, in + 1, USER_ID_SIZE - 1);
+    entry->userID[USER_ID_SIZE - 1] = '\0';
+    memcpy(&node, in + 6, 2);
+    entry->node = ntohs(node);
+    return 0;
+}
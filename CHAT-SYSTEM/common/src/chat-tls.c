@@ -0,0 +1,456 @@
+/*
+ * File: chat-tls.c
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: TLS sessions behind the Conn type (OpenSSL)
+ * Locking: an SSL object must not be read and written at the same time,
+ *          yet the server writes to a client from other threads while the
+ *          client's own thread reads. Every SSL call therefore runs under
+ *          conn->ssl_mutex on a non-blocking socket, and nobody waits for
+ *          the socket while holding the lock.
+ * Output: writers append to a per-connection backlog and send what the
+ *         socket takes. An SSL_write that would block is retried later
+ *         with the same bytes, by the next writer or by the reader, which
+ *         also polls for POLLOUT while a backlog is left. Blocking writers
+ *         then wait (unlocked) until the backlog is gone. Writers of a
+ *         connection in nowait mode (server sessions, written to under
+ *         client_list_mutex) never wait: they leave the backlog to the
+ *         reader, waking it through an eventfd. A peer that lets the
+ *         backlog grow past TLS_BACKLOG_LIMIT is dropped at once.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include "chat-tls.h"
+
+/* Socket events an SSL call that would block is waiting for */
+static short ssl_events(int ssl_error) {
+    return ssl_error == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN;
+}
+
+/**
+ * Waits for socket events, or for a nowait writer leaving a backlog
+ * behind; called without conn->ssl_mutex
+ * @param timeout_ms -1 for no limit
+ * @return socket revents (0 if woken or timed out), -1 on error
+ */
+static int wait_socket(Conn *conn, short events, int timeout_ms) {
+    struct pollfd pfd[2] = {
+        { .fd = conn->fd, .events = events },
+        { .fd = conn->tls_wake, .events = POLLIN }  // ignored by poll() when -1
+    };
+    int ret;
+    while ((ret = poll(pfd, 2, timeout_ms)) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    if (pfd[1].revents & POLLIN) {
+        uint64_t count;
+        if (read(conn->tls_wake, &count, sizeof(count)) < 0) {
+            // Already drained by a concurrent waiter
+        }
+    }
+    return ret > 0 ? pfd[0].revents : 0;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Sends as much of the backlog as the socket takes; caller holds
+ * conn->ssl_mutex
+ * @return 0 when the backlog is gone, the poll events it is waiting for
+ *         otherwise, -1 on error
+ */
+static int flush_locked(Conn *conn) {
+    while (conn->tls_out_off < conn->tls_out_len) {
+        unsigned char *p = conn->tls_out + conn->tls_out_off;
+        size_t left = conn->tls_out_len - conn->tls_out_off;
+        ssize_t n;
+
+        if (conn->ktls_tx) {
+            // The kernel encrypts; the socket BIO would raise SIGPIPE
+            n = send(conn->fd, p, left, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? POLLOUT : -1;
+        } else {
+            // A write that would block must be repeated with the same length
+            if (conn->tls_retry == 0) conn->tls_retry = left < TLS_WRITE_CHUNK ? left : TLS_WRITE_CHUNK;
+            ERR_clear_error();
+            int written = SSL_write(conn->ssl, p, (int)conn->tls_retry);
+            if (written <= 0) {
+                int err = SSL_get_error(conn->ssl, written);
+                if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) return -1;
+                return ssl_events(err);
+            }
+            conn->tls_retry = 0;
+            n = written;
+        }
+        conn->tls_out_off += (size_t)n;
+    }
+    conn->tls_out_off = conn->tls_out_len = 0;
+    return 0;
+}
+
+/**
+ * Appends iovecs to the backlog; caller holds conn->ssl_mutex
+ * Moving the pending bytes is fine: the contexts set
+ * SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+ * @return 0 on success, -1 if out of memory
+ */
+static int queue_locked(Conn *conn, const struct iovec *iov, int iovcnt, size_t total) {
+    if (conn->tls_out_cap - conn->tls_out_len < total && conn->tls_out_off > 0) {
+        conn->tls_out_len -= conn->tls_out_off;
+        memmove(conn->tls_out, conn->tls_out + conn->tls_out_off, conn->tls_out_len);
+        conn->tls_out_off = 0;
+    }
+    if (conn->tls_out_cap - conn->tls_out_len < total) {
+        size_t cap = conn->tls_out_cap > 0 ? conn->tls_out_cap : TLS_WRITE_CHUNK;
+        while (cap - conn->tls_out_len < total) cap *= 2;
+        unsigned char *grown = realloc(conn->tls_out, cap);
+        if (grown == NULL) return -1;
+        conn->tls_out = grown;
+        conn->tls_out_cap = cap;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(conn->tls_out + conn->tls_out_len, iov[i].iov_base, iov[i].iov_len);
+        conn->tls_out_len += iov[i].iov_len;
+    }
+    return 0;
+}
+
+/**
+ * Creates the server context
+ * @return context, or NULL after printing the OpenSSL error
+ */
+SSL_CTX *tls_server_ctx(const char *cert_file, const char *key_file) {
+    static const unsigned char session_id_context[] = "chat-server";
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+
+    if (ctx == NULL ||
+        !SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) ||
+        SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    // Tickets for TLS 1.3 and a session cache for 1.2 both make a
+    // reconnect a resumption instead of a full handshake
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+    SSL_CTX_set_num_tickets(ctx, 1);    // The client only keeps the latest
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    return ctx;
+}
+
+/* Client side: saves each new ticket so the next run can resume */
+static int save_session(SSL *ssl, SSL_SESSION *session) {
+    const char *session_file = SSL_get_app_data(ssl);
+    if (session_file != NULL) {
+        FILE *fp = fopen(session_file, "w");
+        if (fp != NULL) {
+            PEM_write_SSL_SESSION(fp, session);
+            fclose(fp);
+        }
+    }
+    return 0;   // We did not keep a reference
+}
+
+/**
+ * Creates a client context that verifies the server certificate
+ * @param ca_file Trusted certificates (e.g. a self-signed server
+ *                certificate), NULL for the system store
+ * @return context, or NULL after printing the OpenSSL error
+ */
+SSL_CTX *tls_client_ctx(const char *ca_file) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+
+    if (ctx == NULL ||
+        !SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) ||
+        (ca_file != NULL ? SSL_CTX_load_verify_locations(ctx, ca_file, NULL)
+                         : SSL_CTX_set_default_verify_paths(ctx)) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, save_session);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    return ctx;
+}
+
+/**
+ * Peeks at the first byte a new connection sends
+ * @return 1 if it starts a TLS handshake, 0 if not, -1 on error or hangup
+ */
+int tls_sniff(int fd) {
+    unsigned char first;
+    ssize_t n;
+    while ((n = recv(fd, &first, 1, MSG_PEEK)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) return -1;
+    return first == TLS_HANDSHAKE_RECORD;
+}
+
+/* Every write is a whole record already; without this the handshake's
+ * back-to-back small flights stall on delayed ACKs */
+static void no_delay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* Finishes session setup once the handshake is done */
+static int tls_attach(Conn *conn, SSL *ssl) {
+    int flags = fcntl(conn->fd, F_GETFL);
+    if (flags < 0 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) < 0) return -1;
+    conn->ssl = ssl;
+    conn->ktls_tx = BIO_get_ktls_send(SSL_get_wbio(ssl)) ? 1 : 0;
+    return 0;
+}
+
+/**
+ * Switches a session to nowait mode: writers never block, they leave
+ * what the socket does not take to the connection's reader. Call before
+ * anyone else can write to the connection
+ * @return 0 on success, -1 if no eventfd could be created
+ */
+int tls_set_nowait(Conn *conn) {
+    conn->tls_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (conn->tls_wake < 0) return -1;
+    conn->nowait = 1;
+    return 0;
+}
+
+/**
+ * Server side: runs the handshake on an accepted socket
+ * The socket is made non-blocking first, so a client that goes quiet
+ * halfway runs into the deadline instead of holding the thread
+ * @param timeout_ms Time the client has to complete the handshake
+ * @return 0 on success, -1 on failure or timeout (conn stays plaintext)
+ */
+int tls_accept(Conn *conn, SSL_CTX *ctx, int timeout_ms) {
+    SSL *ssl = SSL_new(ctx);
+    uint64_t deadline = now_ms() + (uint64_t)timeout_ms;
+    int flags = fcntl(conn->fd, F_GETFL);
+    int rc = -1;
+
+    no_delay(conn->fd);
+    if (ssl != NULL && flags >= 0 && fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == 0 &&
+        SSL_set_fd(ssl, conn->fd) == 1) {
+        for (;;) {
+            ERR_clear_error();
+            rc = SSL_accept(ssl);
+            if (rc == 1) break;
+            int err = SSL_get_error(ssl, rc);
+            uint64_t now = now_ms();
+            if ((err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) || now >= deadline) break;
+            struct pollfd pfd = { .fd = conn->fd, .events = ssl_events(err) };
+            if (poll(&pfd, 1, (int)(deadline - now)) < 0 && errno != EINTR) break;
+        }
+    }
+    if (rc != 1 || tls_attach(conn, ssl) < 0) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        if (flags >= 0) fcntl(conn->fd, F_SETFL, flags);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Client side: runs the handshake, resuming the session saved in
+ * session_file if there is one
+ * @param host Name or address the server certificate must match
+ * @param session_file Ticket store, NULL to disable resumption
+ * @return 0 on success, -1 on failure (errors printed)
+ */
+int tls_connect(Conn *conn, SSL_CTX *ctx, const char *host, const char *session_file) {
+    SSL *ssl = SSL_new(ctx);
+    unsigned char addr[16];
+
+    if (ssl == NULL || SSL_set_fd(ssl, conn->fd) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return -1;
+    }
+    no_delay(conn->fd);
+    // IP literals are checked against IP SANs, names also go out as SNI
+    if (inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1) {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+    } else {
+        SSL_set_tlsext_host_name(ssl, host);
+        SSL_set1_host(ssl, host);
+    }
+    if (session_file != NULL) {
+        SSL_set_app_data(ssl, (void *)session_file);
+        FILE *fp = fopen(session_file, "r");
+        if (fp != NULL) {
+            SSL_SESSION *session = PEM_read_SSL_SESSION(fp, NULL, NULL, NULL);
+            fclose(fp);
+            if (session != NULL) {
+                SSL_set_session(ssl, session);
+                SSL_SESSION_free(session);
+            }
+        }
+    }
+    if (SSL_connect(ssl) != 1 || tls_attach(conn, ssl) < 0) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads up to len bytes of application data, sending backlog on the way
+ * @return bytes read, 0 on orderly close, -1 on error
+ */
+ssize_t tls_read(Conn *conn, void *buf, size_t len) {
+    for (;;) {
+        pthread_mutex_lock(&conn->ssl_mutex);
+        int want = flush_locked(conn);
+        ERR_clear_error();
+        int n = SSL_read(conn->ssl, buf, len > INT32_MAX ? INT32_MAX : (int)len);
+        int err = n > 0 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, n);
+        pthread_mutex_unlock(&conn->ssl_mutex);
+
+        if (n > 0) return n;
+        if (err == SSL_ERROR_ZERO_RETURN) return 0;
+        if (want < 0) return -1;
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) return -1;
+        if (wait_socket(conn, ssl_events(err) | (want & POLLOUT), -1) < 0) return -1;
+    }
+}
+
+/**
+ * Reads up to len bytes of application data that has already arrived,
+ * sending backlog on the way
+ * @return bytes read, 0 if none has arrived, -1 on close or error
+ */
+ssize_t tls_read_nowait(Conn *conn, void *buf, size_t len) {
+    pthread_mutex_lock(&conn->ssl_mutex);
+    int want = flush_locked(conn);
+    ERR_clear_error();
+    int n = SSL_read(conn->ssl, buf, len > INT32_MAX ? INT32_MAX : (int)len);
+    int err = n > 0 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, n);
+    pthread_mutex_unlock(&conn->ssl_mutex);
+
+    if (n > 0) return n;
+    if (want < 0 || (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)) return -1;
+    return 0;
+}
+
+/**
+ * Writes all iovecs; a frame header and its payload are gathered into
+ * the backlog first, so they leave in one TLS record
+ * @return 0 once sent (or, in nowait mode, queued), -1 on error
+ */
+int tls_writev(Conn *conn, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    pthread_mutex_lock(&conn->ssl_mutex);
+    int had_backlog = conn->tls_out_len > conn->tls_out_off;
+    int want = queue_locked(conn, iov, iovcnt, total) < 0 ? -1 : flush_locked(conn);
+    if (conn->nowait) {
+        if (want > 0 && conn->tls_out_len - conn->tls_out_off > TLS_BACKLOG_LIMIT) {
+            // The peer is too far behind: drop it, its reader cleans up
+            shutdown(conn->fd, SHUT_RDWR);
+            want = -1;
+        }
+    } else {
+        while (want > 0) {
+            pthread_mutex_unlock(&conn->ssl_mutex);
+            int ready = wait_socket(conn, (short)want, -1);
+            pthread_mutex_lock(&conn->ssl_mutex);
+            want = ready < 0 ? -1 : flush_locked(conn);
+        }
+    }
+    if (want > 0 && !had_backlog) {
+        // The reader may be polling without POLLOUT; have it look again
+        uint64_t one = 1;
+        if (write(conn->tls_wake, &one, sizeof(one)) < 0) {
+            // Counter saturated: the reader is awake anyway
+        }
+    }
+    pthread_mutex_unlock(&conn->ssl_mutex);
+    return want < 0 ? -1 : 0;
+}
+
+/**
+ * conn_poll() for TLS sessions: waits for application data while sending
+ * backlog whenever the socket takes more
+ * @return 1 when data is ready, 0 on timeout, -1 on hangup or error
+ */
+int tls_poll(Conn *conn, int timeout_ms) {
+    uint64_t deadline = timeout_ms >= 0 ? now_ms() + (uint64_t)timeout_ms : 0;
+
+    for (;;) {
+        pthread_mutex_lock(&conn->ssl_mutex);
+        int want = flush_locked(conn);
+        int pending = SSL_has_pending(conn->ssl);
+        pthread_mutex_unlock(&conn->ssl_mutex);
+        if (pending) return 1;
+        if (want < 0) return -1;
+
+        int wait_ms = -1;
+        if (timeout_ms >= 0) {
+            uint64_t now = now_ms();
+            wait_ms = now < deadline ? (int)(deadline - now) : 0;
+        }
+        int revents = wait_socket(conn, POLLIN | (want & POLLOUT), wait_ms);
+        if (revents < 0) return -1;
+        // Data first, so a final frame before hangup is still read
+        if (revents & POLLIN) return 1;
+        if (revents & (POLLERR | POLLHUP | POLLNVAL)) return -1;
+        if (revents == 0 && wait_ms >= 0 && now_ms() >= deadline) return 0;
+    }
+}
+
+/* Formats "TLSv1.3 TLS_AES_256_GCM_SHA384, resumed, kTLS tx" for logs */
+void tls_describe(Conn *conn, char *out, size_t size) {
+    snprintf(out, size, "%s %s%s%s", SSL_get_version(conn->ssl),
+             SSL_CIPHER_get_name(SSL_get_current_cipher(conn->ssl)),
+             SSL_session_reused(conn->ssl) ? ", resumed" : "",
+             conn->ktls_tx ? ", kTLS tx" : "");
+}
+
+/* Sends what is left of the backlog and close_notify (best effort,
+ * without waiting) and frees the session */
+void tls_close(Conn *conn) {
+    pthread_mutex_lock(&conn->ssl_mutex);
+    if (flush_locked(conn) == 0) SSL_shutdown(conn->ssl);
+    SSL_free(conn->ssl);
+    conn->ssl = NULL;
+    free(conn->tls_out);
+    conn->tls_out = NULL;
+    conn->tls_out_off = conn->tls_out_len = conn->tls_out_cap = conn->tls_retry = 0;
+    if (conn->tls_wake >= 0) close(conn->tls_wake);
+    conn->tls_wake = -1;
+    pthread_mutex_unlock(&conn->ssl_mutex);
+}
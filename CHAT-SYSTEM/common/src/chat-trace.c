@@ -0,0 +1,122 @@
+/*
+ * File: chat-trace.c
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Sampling and per-stage latency histograms for the
+ *              message lifecycle tracepoints (see chat-trace.h)
+ */
+
+#include <string.h>
+
+#include "chat-trace.h"
+
+#define TRACE_STAGES (TRACE_POINTS - 1)
+
+/* Latency distribution of one stage (all fields atomic) */
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[TRACE_BUCKETS];    // [2^(i-1), 2^i) ns, bucket 0 is 0 ns
+} StageHistogram;
+
+unsigned trace_every = 0;
+
+/* Stage i spans point i to point i + 1; the last entry spans the lot */
+static const char *stage_names[TRACE_STAGES + 1] = {
+    "read", "prepare", "lock wait", "format", "write", "total"
+};
+static StageHistogram stages[TRACE_STAGES + 1];
+static __thread unsigned sample_countdown;  // Frames until this thread samples
+
+/**
+ * Starts the trace of a frame whose header was just read
+ * @param stream Session id of the sender
+ * @param length Payload length announced by the header
+ */
+void trace_begin(MessageTrace *trace, uint32_t stream, uint32_t length) {
+    memset(trace, 0, sizeof(*trace));   // A stage the frame skips stays 0
+    trace->stream = stream;
+    CHAT_PROBE2(message__received, stream, length);
+    if (trace_every == 0) return;
+    if (sample_countdown == 0) {
+        sample_countdown = trace_every;
+        trace->sampled = 1;
+        trace->at[TRACE_RECEIVED] = trace_clock();
+    }
+    sample_countdown--;
+}
+
+static void record(StageHistogram *stage, uint64_t ns) {
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= TRACE_BUCKETS) bucket = TRACE_BUCKETS - 1;
+
+    __atomic_add_fetch(&stage->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stage->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stage->buckets[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&stage->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&stage->max_ns, &max, ns, 0,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Folds a delivered frame's timestamps into the stage histograms
+ * Frames that were dropped before delivery are simply never ended; one
+ * that missed a stage anyway (its sender was gone by the time the lock
+ * was taken) is left out
+ */
+void trace_end(MessageTrace *trace) {
+    if (!trace->sampled) return;
+    for (int i = 0; i < TRACE_POINTS; i++) {
+        if (trace->at[i] == 0) return;
+    }
+    for (int i = 0; i < TRACE_STAGES; i++) {
+        record(&stages[i], trace->at[i + 1] - trace->at[i]);
+    }
+    record(&stages[TRACE_STAGES], trace->at[TRACE_WRITTEN] - trace->at[TRACE_RECEIVED]);
+}
+
+/* Formats a duration as "850ns", "12.3us" or "4.10ms" */
+static void format_ns(char *out, size_t size, uint64_t ns) {
+    if (ns < 1000) snprintf(out, size, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000) snprintf(out, size, "%.1fus", ns / 1e3);
+    else snprintf(out, size, "%.2fms", ns / 1e6);
+}
+
+/* Upper bound of the bucket holding the given fraction of samples */
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, double fraction) {
+    uint64_t rank = (uint64_t)(count * fraction), seen = 0;
+    for (int i = 0; i < TRACE_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) return i == 0 ? 0 : 1ull << i;
+    }
+    return 1ull << (TRACE_BUCKETS - 1);
+}
+
+/* Prints the per-stage latency breakdown of sampled frames */
+void trace_dump(FILE *out) {
+    fprintf(out, "--- trace: 1 frame in %u sampled, p50/p99 are log2 bucket bounds ---\n",
+            trace_every);
+    fprintf(out, "  %-9s %9s %9s %9s %9s %9s\n", "stage", "samples", "mean", "p50", "p99", "max");
+    for (int i = 0; i <= TRACE_STAGES; i++) {
+        StageHistogram snap;
+        char mean[16], p50[16], p99[16], max[16];
+
+        for (int b = 0; b < TRACE_BUCKETS; b++) {
+            snap.buckets[b] = __atomic_load_n(&stages[i].buckets[b], __ATOMIC_RELAXED);
+        }
+        snap.count = __atomic_load_n(&stages[i].count, __ATOMIC_RELAXED);
+        snap.sum_ns = __atomic_load_n(&stages[i].sum_ns, __ATOMIC_RELAXED);
+        snap.max_ns = __atomic_load_n(&stages[i].max_ns, __ATOMIC_RELAXED);
+        if (snap.count == 0) continue;
+
+        format_ns(mean, sizeof(mean), snap.sum_ns / snap.count);
+        format_ns(p50, sizeof(p50), percentile(snap.buckets, snap.count, 0.50));
+        format_ns(p99, sizeof(p99), percentile(snap.buckets, snap.count, 0.99));
+        format_ns(max, sizeof(max), snap.max_ns);
+        fprintf(out, "  %-9s %9llu %9s %9s %9s %9s\n", stage_names[i],
+                (unsigned long long)snap.count, mean, p50, p99, max);
+    }
+}
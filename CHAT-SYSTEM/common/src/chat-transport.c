@@ -0,0 +1,566 @@
+/*
+ * File: chat-transport.c
+ * Date: 2026-10-19
+ * Sp_04
+ * Group member: Deyi, Zhizheng
+ * Description: Socket and shared-memory ring I/O behind the Conn type
+ * Ring protocol: head and tail are free-running byte counters. The producer
+ *                copies data, publishes head, bumps data_seq and wakes the
+ *                consumer only if it flagged itself parked; the consumer
+ *                mirrors this with tail/space_seq. All flag and cursor
+ *                accesses are sequentially consistent, so a wakeup cannot
+ *                be lost between the last check and FUTEX_WAIT.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "chat-transport.h"
+#include "chat-tls.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+#define RING_TOTAL(cap) (sizeof(ShmRing) + (cap))
+
+/* Initialises a connection over a connected socket */
+void conn_init(Conn *conn, int fd) {
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    conn->tls_wake = -1;
+    pthread_mutex_init(&conn->ssl_mutex, NULL);
+}
+
+/**
+ * Enables busy polling: readers spin for usecs before blocking
+ * @return 0 on success, -1 if the kernel refused SO_BUSY_POLL (raising it
+ *         above net.core.busy_read needs CAP_NET_ADMIN); the user-space
+ *         spin applies either way
+ */
+int conn_set_busy_poll(Conn *conn, int usecs) {
+    conn->busy_poll_us = usecs;
+    return setsockopt(conn->fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+}
+
+/**
+ * Switches a connection to nowait mode (see chat-transport.h); call
+ * before anyone else can write to it
+ * @return 0 on success, -1 if a TLS session could not be set up for it
+ */
+int conn_set_nowait(Conn *conn) {
+    if (conn->ssl != NULL) return tls_set_nowait(conn);
+    conn->nowait = 1;
+    return 0;
+}
+
+static uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void futex_wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Marks a ring closed and wakes whoever is parked on it */
+static void ring_close(ShmRing *ring) {
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ring->data_seq, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ring->space_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&ring->data_seq);
+    futex_wake(&ring->space_seq);
+}
+
+/* Closes the socket and, for shm connections, unmaps the rings */
+void conn_close(Conn *conn) {
+    if (conn->ssl != NULL) tls_close(conn);
+    if (conn->shm_base != NULL) {
+        ring_close(conn->rx);
+        ring_close(conn->tx);
+        munmap(conn->shm_base, conn->shm_size);
+        conn->shm_base = NULL;
+        conn->rx = conn->tx = NULL;
+    }
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+/* Once rings carry the traffic, any event on the socket means hangup */
+static int peer_gone(Conn *conn) {
+    struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) != 0;
+}
+
+static int ring_readable(ShmRing *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail;
+}
+
+static int ring_writable(ShmRing *ring) {
+    return __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) + ring->capacity != ring->head;
+}
+
+/* Spinning only pays off if the peer can run meanwhile on another CPU */
+static int spin_limit(void) {
+    static int limit = -1;
+    if (limit < 0) limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_LIMIT : 0;
+    return limit;
+}
+
+/**
+ * Waits until ready(ring) holds: spins first, then parks on the futex word
+ * @param max_wait_ms -1 to wait until ready or hangup, otherwise the time
+ *        limit; parking is still cut into LIVENESS_CHECK_MS slices
+ * @return 0 when ready, 1 on timeout, -1 if the peer is gone
+ */
+static int ring_wait(Conn *conn, ShmRing *ring, uint32_t *seq, uint32_t *waiting,
+                     int (*ready)(ShmRing *), int max_wait_ms) {
+    if (conn->busy_poll_us > 0) {
+        // Busy poll was asked for explicitly, so it spins even on one CPU
+        uint64_t deadline = now_us() + conn->busy_poll_us;
+        do {
+            for (int spin = 0; spin < 64; spin++) {
+                if (ready(ring)) return 0;
+                cpu_relax();
+            }
+        } while (now_us() < deadline);
+    } else {
+        int limit = spin_limit();
+        for (int spin = 0; spin < limit; spin++) {
+            if (ready(ring)) return 0;
+            cpu_relax();
+        }
+    }
+    uint64_t deadline = max_wait_ms >= 0 ? now_us() + (uint64_t)max_wait_ms * 1000 : 0;
+    for (;;) {
+        uint32_t observed = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+        if (ready(ring)) return 0;
+        if (__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST)) return -1;
+
+        int park_ms = LIVENESS_CHECK_MS;
+        if (max_wait_ms >= 0) {
+            uint64_t now = now_us();
+            if (now >= deadline) return 1;
+            if (deadline - now < LIVENESS_CHECK_MS * 1000ull) {
+                park_ms = (int)((deadline - now + 999) / 1000);
+            }
+        }
+        struct timespec timeout = { park_ms / 1000, (park_ms % 1000) * 1000000L };
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+        if (!ready(ring)) {
+            syscall(SYS_futex, seq, FUTEX_WAIT, observed, &timeout, NULL, 0);
+        }
+        __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+
+        if (ready(ring)) return 0;
+        if (peer_gone(conn)) return -1;
+    }
+}
+
+/**
+ * Copies up to len bytes that have arrived out of the receive ring and
+ * hands their space back to the producer
+ * @return bytes copied, 0 if the ring is empty
+ */
+static size_t ring_take(ShmRing *ring, unsigned char *buf, size_t len) {
+    uint64_t mask = ring->capacity - 1;
+    uint64_t tail = ring->tail;
+    uint64_t avail = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) - tail;
+    if (avail == 0) return 0;
+
+    size_t n = avail < len ? (size_t)avail : len;
+    size_t offset = tail & mask;
+    size_t first = n < ring->capacity - offset ? n : ring->capacity - offset;
+    memcpy(buf, ring->data + offset, first);
+    memcpy(buf + first, ring->data, n - first);
+
+    __atomic_store_n(&ring->tail, tail + n, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ring->space_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->space_waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(&ring->space_seq);
+    }
+    return n;
+}
+
+/* Consumes exactly len bytes from the receive ring */
+static int ring_read(Conn *conn, unsigned char *buf, size_t len) {
+    ShmRing *ring = conn->rx;
+
+    while (len > 0) {
+        size_t n = ring_take(ring, buf, len);
+        if (n == 0) {
+            if (ring_wait(conn, ring, &ring->data_seq, &ring->data_waiting,
+                          ring_readable, -1) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Publishes head and wakes a parked consumer */
+static void ring_publish(ShmRing *ring, uint64_t head) {
+    __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ring->data_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->data_waiting, __ATOMIC_SEQ_CST)) {
+        futex_wake(&ring->data_seq);
+    }
+}
+
+/**
+ * Produces all iovecs into the send ring, publishing once at the end (or
+ * whenever the ring fills) so a frame normally costs a single wakeup
+ * In nowait mode a full ring is waited on for at most CONN_STALL_MS, then
+ * both rings are closed and the socket shut down
+ */
+static int ring_writev(Conn *conn, const struct iovec *iov, int iovcnt) {
+    ShmRing *ring = conn->tx;
+    uint64_t mask = ring->capacity - 1;
+    uint64_t head = ring->head;
+    uint64_t give_up = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        const unsigned char *p = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (len > 0) {
+            uint64_t space = ring->capacity -
+                             (head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST));
+            if (space == 0) {
+                ring_publish(ring, head);
+                int wait_ms = -1;
+                if (conn->nowait) {
+                    uint64_t now = now_us();
+                    if (give_up == 0) give_up = now + CONN_STALL_MS * 1000ull;
+                    wait_ms = now < give_up ? (int)((give_up - now + 999) / 1000) : 0;
+                }
+                int rc = ring_wait(conn, ring, &ring->space_seq, &ring->space_waiting,
+                                   ring_writable, wait_ms);
+                if (rc == 1) {
+                    // The peer stopped reading: drop it, its reader cleans up
+                    ring_close(conn->tx);
+                    ring_close(conn->rx);
+                    shutdown(conn->fd, SHUT_RDWR);
+                    errno = ETIMEDOUT;
+                }
+                if (rc != 0) return -1;
+                continue;
+            }
+
+            size_t n = space < len ? (size_t)space : len;
+            size_t offset = head & mask;
+            size_t first = n < ring->capacity - offset ? n : ring->capacity - offset;
+            memcpy(ring->data + offset, p, first);
+            memcpy(ring->data, p + first, n - first);
+            head += n;
+            p += n;
+            len -= n;
+        }
+    }
+    ring_publish(ring, head);
+    return 0;
+}
+
+/* Plain socket read; in busy-poll mode non-blocking reads are retried
+ * until data arrives or busy_poll_us runs out, then it blocks */
+static ssize_t socket_read(Conn *conn, void *buf, size_t len) {
+    if (conn->busy_poll_us > 0) {
+        uint64_t deadline = now_us() + conn->busy_poll_us;
+        do {
+            ssize_t n = recv(conn->fd, buf, len, MSG_DONTWAIT);
+            if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) return n;
+            cpu_relax();
+        } while (now_us() < deadline);
+    }
+    return read(conn->fd, buf, len);
+}
+
+/**
+ * Reads exactly len bytes, retrying on short reads and EINTR
+ * @return 0 on success, -1 on error or end of stream
+ */
+int read_full(Conn *conn, void *buf, size_t len) {
+    if (conn->rx != NULL) return ring_read(conn, buf, len);
+
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = conn->ssl != NULL ? tls_read(conn, p, len) : socket_read(conn, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Reads exactly len bytes unless nothing at all arrives within timeout_ms
+ * A socket is tried with a non-blocking read first, so a busy connection
+ * costs no more than read_full(); only an empty one waits in conn_poll()
+ * @param timeout_ms Idle limit, -1 waits indefinitely like read_full()
+ * @return 0 on success, 1 on timeout with nothing read, -1 on error or
+ *         end of stream
+ */
+int read_full_timeout(Conn *conn, void *buf, size_t len, int timeout_ms) {
+    if (timeout_ms < 0 || len == 0) return read_full(conn, buf, len);
+
+    if (conn->rx == NULL && conn->ssl == NULL) {
+        ssize_t n;
+        do {
+            n = recv(conn->fd, buf, len, MSG_DONTWAIT);
+        } while (n < 0 && errno == EINTR);
+        if (n == 0) return -1;
+        if (n > 0) return read_full(conn, (unsigned char *)buf + n, len - (size_t)n);
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    }
+    int ready = conn_poll(conn, timeout_ms);
+    if (ready <= 0) return ready < 0 ? -1 : 1;
+    return read_full(conn, buf, len);
+}
+
+/**
+ * Reads whatever has arrived, up to len bytes, without waiting; with
+ * conn_poll() for when nothing has, one call can return many frames
+ * @return bytes read, 0 if nothing has arrived, -1 on error or end of
+ *         stream
+ */
+ssize_t conn_read_nowait(Conn *conn, void *buf, size_t len) {
+    if (conn->rx != NULL) {
+        size_t n = ring_take(conn->rx, buf, len);
+        if (n == 0 && __atomic_load_n(&conn->rx->closed, __ATOMIC_SEQ_CST)) return -1;
+        return (ssize_t)n;
+    }
+    if (conn->ssl != NULL) return tls_read_nowait(conn, buf, len);
+
+    ssize_t n;
+    do {
+        n = recv(conn->fd, buf, len, MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) return n;
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+}
+
+/**
+ * Writes exactly len bytes without raising SIGPIPE
+ * @return 0 on success, -1 on error
+ */
+int write_full(Conn *conn, const void *buf, size_t len) {
+    struct iovec iov = { (void *)buf, len };
+    return conn_writev(conn, &iov, 1);
+}
+
+/**
+ * sendmsg() loop behind conn_writev(); in nowait mode the socket is not
+ * waited on for longer than CONN_STALL_MS, and a peer that stays full
+ * that long is shut down
+ */
+static int socket_writev(Conn *conn, const struct iovec *iov, int iovcnt) {
+    struct iovec local[8];
+    struct msghdr msg;
+    uint64_t give_up = 0;
+    if (iovcnt > 8) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(local, iov, iovcnt * sizeof(*iov));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = local;
+    msg.msg_iovlen = iovcnt;
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (conn->nowait ? MSG_DONTWAIT : 0));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { .fd = conn->fd, .events = POLLOUT };
+            int wait_ms = -1;
+            if (conn->nowait) {
+                uint64_t now = now_us();
+                if (give_up == 0) give_up = now + CONN_STALL_MS * 1000ull;
+                wait_ms = now < give_up ? (int)((give_up - now + 999) / 1000) : 0;
+            }
+            if (poll(&pfd, 1, wait_ms) == 0) {
+                // The peer stopped reading: drop it, its reader cleans up
+                shutdown(conn->fd, SHUT_RDWR);
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            continue;
+        }
+        if (n <= 0) return -1;
+
+        // Short write: advance past what the kernel took
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes all iovecs, in one sendmsg() call when the socket takes it all
+ * @return 0 on success, -1 on error
+ */
+int conn_writev(Conn *conn, const struct iovec *iov, int iovcnt) {
+    if (conn->tx != NULL) return ring_writev(conn, iov, iovcnt);
+    if (conn->ssl != NULL) return tls_writev(conn, iov, iovcnt);
+    return socket_writev(conn, iov, iovcnt);
+}
+
+/**
+ * Waits up to timeout_ms for incoming data
+ * @return 1 if data is ready, 0 on timeout, -1 on hangup or error
+ */
+int conn_poll(Conn *conn, int timeout_ms) {
+    if (conn->rx != NULL) {
+        int rc = ring_wait(conn, conn->rx, &conn->rx->data_seq, &conn->rx->data_waiting,
+                           ring_readable, timeout_ms);
+        return rc == 0 ? 1 : rc == 1 ? 0 : -1;
+    }
+
+    if (conn->ssl != NULL) return tls_poll(conn, timeout_ms);
+    struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+    int ret = 0;
+    if (conn->busy_poll_us > 0 && timeout_ms != 0) {
+        uint64_t deadline = now_us() + conn->busy_poll_us;
+        while ((ret = poll(&pfd, 1, 0)) == 0 && now_us() < deadline) {
+            cpu_relax();
+        }
+    }
+    if (ret == 0) ret = poll(&pfd, 1, timeout_ms);
+    if (ret <= 0) return ret < 0 && errno != EINTR ? -1 : 0;
+    // Data first, so a final frame before hangup is still read
+    if (pfd.revents & POLLIN) return 1;
+    return -1;
+}
+
+/* Lays out one ring at base */
+static ShmRing *ring_init(unsigned char *base, size_t capacity) {
+    ShmRing *ring = (ShmRing *)base;
+    memset(ring, 0, sizeof(*ring));
+    ring->capacity = (uint32_t)capacity;
+    return ring;
+}
+
+/**
+ * Server side: creates the ring pair, hands it to the client over the
+ * AF_UNIX socket and switches conn to it
+ * @param ring_size Data bytes per direction, power of two
+ * @return 0 on success, -1 on failure (conn stays on the socket)
+ */
+int shm_offer(Conn *conn, size_t ring_size) {
+    size_t total = 2 * RING_TOTAL(ring_size);
+    int memfd = memfd_create("chat-shm", MFD_CLOEXEC);
+    if (memfd < 0) return -1;
+    if (ftruncate(memfd, total) < 0) {
+        close(memfd);
+        return -1;
+    }
+    unsigned char *base = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (base == MAP_FAILED) {
+        close(memfd);
+        return -1;
+    }
+
+    // Ring 0 carries client -> server, ring 1 server -> client
+    ShmRing *c2s = ring_init(base, ring_size);
+    ShmRing *s2c = ring_init(base + RING_TOTAL(ring_size), ring_size);
+
+    char marker = 'R';
+    struct iovec iov = { &marker, 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    int rc = sendmsg(conn->fd, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+    close(memfd);   // the mapping and the client's copy keep it alive
+    if (rc < 0) {
+        munmap(base, total);
+        return -1;
+    }
+    conn->shm_base = base;
+    conn->shm_size = total;
+    conn->rx = c2s;
+    conn->tx = s2c;
+    return 0;
+}
+
+/**
+ * Client side: receives the ring pair offered by shm_offer() and switches
+ * conn to it
+ * @return 0 on success, -1 on failure
+ */
+int shm_accept(Conn *conn) {
+    char marker;
+    struct iovec iov = { &marker, 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC) != 1) return -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int memfd;
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+    struct stat st;
+    if (fstat(memfd, &st) < 0 || (size_t)st.st_size < 2 * sizeof(ShmRing)) {
+        close(memfd);
+        return -1;
+    }
+    size_t total = st.st_size;
+    unsigned char *base = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+    if (base == MAP_FAILED) return -1;
+
+    // Validate the layout before trusting capacities from the mapping
+    ShmRing *c2s = (ShmRing *)base;
+    size_t capacity = c2s->capacity;
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+        2 * RING_TOTAL(capacity) != total) {
+        munmap(base, total);
+        return -1;
+    }
+    conn->shm_base = base;
+    conn->shm_size = total;
+    conn->tx = c2s;
+    conn->rx = (ShmRing *)(base + RING_TOTAL(capacity));
+    return 0;
+}